@@ -0,0 +1,61 @@
+#include "arena.h"
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_MIN_BLOCK_SIZE (64 * 1024)
+
+struct ArenaBlock {
+    struct ArenaBlock* prev;
+    size_t size; // bytes of data after the header
+    size_t used;
+    size_t padding; // keeps the header a multiple of ARENA_ALIGNMENT
+};
+
+void Arena_init(struct Arena* arena)
+{
+    arena->block = NULL;
+}
+
+void Arena_destroy(struct Arena* arena)
+{
+    struct ArenaBlock* block = arena->block;
+    while (block) {
+        struct ArenaBlock* prev = block->prev;
+        free(block);
+        block = prev;
+    }
+    arena->block = NULL;
+}
+
+void* Arena_alloc(struct Arena* arena, size_t size)
+{
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+    struct ArenaBlock* block = arena->block;
+    if (!block || block->size - block->used < size) {
+        // doubling keeps the number of blocks logarithmic in the total size
+        size_t block_size = block ? 2 * block->size : ARENA_MIN_BLOCK_SIZE;
+        if (block_size < size) {
+            block_size = size;
+        }
+
+        struct ArenaBlock* new_block = malloc(sizeof(struct ArenaBlock) + block_size);
+        new_block->prev = block;
+        new_block->size = block_size;
+        new_block->used = 0;
+        arena->block = new_block;
+        block = new_block;
+    }
+
+    void* ptr = (unsigned char*)(block + 1) + block->used;
+    block->used += size;
+    return ptr;
+}
+
+size_t Arena_capacity(const struct Arena* arena)
+{
+    size_t capacity = 0;
+    for (const struct ArenaBlock* block = arena->block; block; block = block->prev) {
+        capacity += block->size;
+    }
+    return capacity;
+}
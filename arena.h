@@ -0,0 +1,20 @@
+#ifndef TOYCC_ARENA_H
+#define TOYCC_ARENA_H
+#include <stdlib.h>
+
+struct ArenaBlock;
+
+/// A bump allocator. Allocations are never freed one by one, the whole arena goes at once
+struct Arena {
+    struct ArenaBlock* block; // the block being filled, it links to the previous ones
+};
+
+void Arena_init(struct Arena* arena);
+/// Free every allocation, in one step per block rather than per allocation
+void Arena_destroy(struct Arena* arena);
+/// size bytes aligned to 16, uninitialized
+void* Arena_alloc(struct Arena* arena, size_t size);
+/// Total size of the blocks, for statistics
+size_t Arena_capacity(const struct Arena* arena);
+
+#endif //TOYCC_ARENA_H
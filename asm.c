@@ -0,0 +1,355 @@
+#include <stdio.h>
+#include <string.h>
+#include "asm.h"
+#include "util.h"
+
+static const char* reg_names[] = {
+        "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+};
+
+static const char* byte_reg_names[] = {
+        "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+        "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b",
+};
+
+struct Operand Operand_reg(enum Register reg)
+{
+    struct Operand op;
+    op.kind = OPERAND_REG;
+    op.data.reg = reg;
+    return op;
+}
+
+struct Operand Operand_vreg(unsigned int vreg)
+{
+    return Operand_reg(REG_COUNT + vreg);
+}
+
+struct Operand Operand_imm(int64_t imm)
+{
+    struct Operand op;
+    op.kind = OPERAND_IMM;
+    op.data.imm = imm;
+    return op;
+}
+
+struct Operand Operand_mem(enum Register base, int32_t disp)
+{
+    struct Operand op;
+    op.kind = OPERAND_MEM;
+    op.data.mem.base = base;
+    op.data.mem.disp = disp;
+    return op;
+}
+
+struct Operand Operand_label(unsigned int label)
+{
+    struct Operand op;
+    op.kind = OPERAND_LABEL;
+    op.data.label = label;
+    return op;
+}
+
+static struct Operand Operand_none()
+{
+    struct Operand op;
+    op.kind = OPERAND_NONE;
+    return op;
+}
+
+void AsmBuffer_init(struct AsmBuffer* buf)
+{
+    dynarray_init(&buf->instructions, sizeof(struct Instruction));
+    dynarray_init(&buf->labels, sizeof(struct Label));
+    hashmap_init(&buf->named_labels, sizeof(unsigned int));
+    dynarray_init(&buf->functions, sizeof(struct AsmFunction));
+    buf->vreg_count = 0;
+}
+
+void AsmBuffer_destroy(struct AsmBuffer* buf)
+{
+    dynarray_destroy(&buf->instructions);
+    dynarray_destroy(&buf->labels);
+    hashmap_destroy(&buf->named_labels);
+    dynarray_destroy(&buf->functions);
+}
+
+/// Return the id of the label with this name, creating it on first use
+unsigned int asm_named_label(struct AsmBuffer* buf, const char* name)
+{
+    unsigned int id;
+    if (hashmap_get(&buf->named_labels, name, &id)) {
+        return id;
+    }
+
+    id = asm_local_label(buf, name, -1);
+    hashmap_set(&buf->named_labels, name, &id);
+    return id;
+}
+
+unsigned int asm_local_label(struct AsmBuffer* buf, const char* name, int num)
+{
+    struct Label label;
+    label.name = name;
+    label.num = num;
+    label.global = false;
+
+    unsigned int id = dynarray_length(&buf->labels);
+    dynarray_push(&buf->labels, &label);
+    return id;
+}
+
+unsigned int asm_new_vreg(struct AsmBuffer* buf)
+{
+    return buf->vreg_count++;
+}
+
+static void emit(struct AsmBuffer* buf, enum AsmOp op, enum Condition cond, struct Operand a, struct Operand b)
+{
+    struct Instruction insn;
+    insn.op = op;
+    insn.cond = cond;
+    insn.operands[0] = a;
+    insn.operands[1] = b;
+    dynarray_push(&buf->instructions, &insn);
+}
+
+void asm_emit0(struct AsmBuffer* buf, enum AsmOp op)
+{
+    emit(buf, op, COND_E, Operand_none(), Operand_none());
+}
+
+void asm_emit1(struct AsmBuffer* buf, enum AsmOp op, struct Operand a)
+{
+    emit(buf, op, COND_E, a, Operand_none());
+}
+
+void asm_emit2(struct AsmBuffer* buf, enum AsmOp op, struct Operand dst, struct Operand src)
+{
+    emit(buf, op, COND_E, dst, src);
+}
+
+void asm_emit_jcc(struct AsmBuffer* buf, enum Condition cond, unsigned int label)
+{
+    emit(buf, ASM_JCC, cond, Operand_label(label), Operand_none());
+}
+
+void asm_emit_setcc(struct AsmBuffer* buf, enum Condition cond, enum Register reg)
+{
+    emit(buf, ASM_SETCC, cond, Operand_reg(reg), Operand_none());
+}
+
+void asm_emit_label(struct AsmBuffer* buf, unsigned int label)
+{
+    emit(buf, ASM_LABEL, COND_E, Operand_label(label), Operand_none());
+}
+
+void asm_begin_function(struct AsmBuffer* buf, const char* name)
+{
+    struct AsmFunction fun;
+    fun.label = asm_named_label(buf, name);
+    fun.end_label = asm_local_label(buf, "function.end", dynarray_length(&buf->functions));
+    fun.begin = dynarray_length(&buf->instructions);
+    fun.end = fun.begin;
+    fun.frame_insn = SIZE_MAX;
+    fun.first_vreg = buf->vreg_count;
+    fun.end_vreg = buf->vreg_count;
+    dynarray_push(&buf->functions, &fun);
+
+    asm_emit_label(buf, fun.label);
+}
+
+static struct AsmFunction* current_function(struct AsmBuffer* buf)
+{
+    ASSERT(dynarray_length(&buf->functions) > 0)
+    return dynarray_get(&buf->functions, dynarray_length(&buf->functions)-1);
+}
+
+void asm_end_function(struct AsmBuffer* buf)
+{
+    struct AsmFunction* fun = current_function(buf);
+    asm_emit_label(buf, fun->end_label);
+    fun->end = dynarray_length(&buf->instructions);
+    fun->end_vreg = buf->vreg_count;
+}
+
+/// Allocate the stack frame. The register allocator grows it when it needs spill slots
+void asm_emit_frame_setup(struct AsmBuffer* buf, unsigned int frame_size)
+{
+    current_function(buf)->frame_insn = dynarray_length(&buf->instructions);
+    asm_emit2(buf, ASM_SUB, Operand_reg(REG_RSP), Operand_imm(frame_size));
+}
+
+enum Condition invert_condition(enum Condition cond)
+{
+    // the encodings come in pairs that only differ by the low bit
+    return cond ^ 1;
+}
+
+static const char* condition_suffix(enum Condition cond)
+{
+    switch(cond) {
+        case COND_E:
+            return "e";
+        case COND_NE:
+            return "ne";
+        case COND_L:
+            return "l";
+        case COND_GE:
+            return "ge";
+        case COND_LE:
+            return "le";
+        case COND_G:
+            return "g";
+    }
+
+    ASSERT(0 && "Unknown condition");
+    return NULL;
+}
+
+static const char* op_mnemonic(enum AsmOp op)
+{
+    switch(op) {
+        case ASM_ADD:
+            return "add";
+        case ASM_CALL:
+            return "call";
+        case ASM_CMP:
+            return "cmp";
+        case ASM_CQO:
+            return "cqo";
+        case ASM_IDIV:
+            return "idiv";
+        case ASM_IMUL:
+            return "imul";
+        case ASM_INC:
+            return "inc";
+        case ASM_JMP:
+            return "jmp";
+        case ASM_LEA:
+            return "lea";
+        case ASM_MOV:
+            return "mov";
+        case ASM_POP:
+            return "pop";
+        case ASM_PUSH:
+            return "push";
+        case ASM_RET:
+            return "ret";
+        case ASM_SUB:
+            return "sub";
+        case ASM_SYSCALL:
+            return "syscall";
+        case ASM_TEST:
+            return "test";
+        case ASM_XOR:
+            return "xor";
+
+        // printed separately
+        case ASM_JCC:
+        case ASM_LABEL:
+        case ASM_SETCC:
+            break;
+    }
+
+    ASSERT(0 && "Unknown opcode");
+    return NULL;
+}
+
+static void print_label(const struct AsmBuffer* buf, unsigned int id, FILE* fp)
+{
+    const struct Label* label = dynarray_get(&buf->labels, id);
+    if (label->num < 0) {
+        fprintf(fp, "%s", label->name);
+    } else {
+        fprintf(fp, "%s.%d", label->name, label->num);
+    }
+}
+
+// memory operands need an explicit size when no register operand gives it
+static void print_operand(const struct AsmBuffer* buf, struct Operand op, bool sized, FILE* fp)
+{
+    switch(op.kind) {
+        case OPERAND_NONE:
+            break;
+
+        case OPERAND_IMM:
+            fprintf(fp, "%ld", op.data.imm);
+            break;
+
+        case OPERAND_LABEL:
+            print_label(buf, op.data.label, fp);
+            break;
+
+        case OPERAND_MEM:
+            fprintf(fp, "%s[%s", sized ? "qword " : "", reg_names[op.data.mem.base]);
+            if (op.data.mem.disp > 0) {
+                fprintf(fp, "+%d", op.data.mem.disp);
+            } else if (op.data.mem.disp < 0) {
+                fprintf(fp, "%d", op.data.mem.disp);
+            }
+            fprintf(fp, "]");
+            break;
+
+        case OPERAND_REG:
+            if (IS_VREG(op.data.reg)) {
+                fprintf(fp, "v%u", op.data.reg - REG_COUNT);
+            } else {
+                fprintf(fp, "%s", reg_names[op.data.reg]);
+            }
+            break;
+    }
+}
+
+void asm_print(const struct AsmBuffer* buf, FILE* fp)
+{
+    for (size_t i = 0; i < dynarray_length(&buf->labels); i++) {
+        const struct Label* label = dynarray_get(&buf->labels, i);
+        if (label->global) {
+            fprintf(fp, "global %s\n", label->name);
+        }
+    }
+    fprintf(fp, "section .text\n");
+
+    for (size_t i = 0; i < dynarray_length(&buf->instructions); i++) {
+        const struct Instruction* insn = dynarray_get(&buf->instructions, i);
+        switch(insn->op) {
+            case ASM_LABEL:
+                print_label(buf, insn->operands[0].data.label, fp);
+                fprintf(fp, ":\n");
+                continue;
+
+            case ASM_JCC:
+                fprintf(fp, "j%s ", condition_suffix(insn->cond));
+                print_label(buf, insn->operands[0].data.label, fp);
+                fprintf(fp, "\n");
+                continue;
+
+            case ASM_SETCC:
+                fprintf(fp, "set%s ", condition_suffix(insn->cond));
+                if (IS_VREG(insn->operands[0].data.reg)) {
+                    print_operand(buf, insn->operands[0], false, fp);
+                } else {
+                    fprintf(fp, "%s", byte_reg_names[insn->operands[0].data.reg]);
+                }
+                fprintf(fp, "\n");
+                continue;
+
+            default:
+                break;
+        }
+
+        fprintf(fp, "%s", op_mnemonic(insn->op));
+        if (insn->operands[0].kind != OPERAND_NONE) {
+            bool sized = insn->operands[0].kind != OPERAND_REG && insn->operands[1].kind != OPERAND_REG;
+            fprintf(fp, " ");
+            print_operand(buf, insn->operands[0], sized, fp);
+            if (insn->operands[1].kind != OPERAND_NONE) {
+                fprintf(fp, ",");
+                print_operand(buf, insn->operands[1], sized, fp);
+            }
+        }
+        fprintf(fp, "\n");
+    }
+}
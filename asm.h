@@ -0,0 +1,166 @@
+#ifndef TOYCC_ASM_H
+#define TOYCC_ASM_H
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "dynarray.h"
+#include "hashmap.h"
+
+// the values match the register numbers used in the x86-64 instruction encoding
+enum Register {
+    REG_RAX,
+    REG_RCX,
+    REG_RDX,
+    REG_RBX,
+    REG_RSP,
+    REG_RBP,
+    REG_RSI,
+    REG_RDI,
+    REG_R8,
+    REG_R9,
+    REG_R10,
+    REG_R11,
+    REG_R12,
+    REG_R13,
+    REG_R14,
+    REG_R15,
+    REG_COUNT,
+};
+
+// virtual registers are numbered from REG_COUNT onwards until the register allocator replaces them
+#define IS_VREG(reg) ((reg) >= REG_COUNT)
+
+// the values match the condition codes used in the jcc/setcc encodings
+enum Condition {
+    COND_E = 0x4,
+    COND_NE = 0x5,
+    COND_L = 0xc,
+    COND_GE = 0xd,
+    COND_LE = 0xe,
+    COND_G = 0xf,
+};
+
+enum AsmOp {
+    ASM_ADD,
+    ASM_CALL,
+    ASM_CMP,
+    ASM_CQO,
+    ASM_IDIV,
+    ASM_IMUL,
+    ASM_INC,
+    ASM_JCC,
+    ASM_JMP,
+    ASM_LABEL,
+    ASM_LEA,
+    ASM_MOV,
+    ASM_POP,
+    ASM_PUSH,
+    ASM_RET,
+    ASM_SETCC,
+    ASM_SUB,
+    ASM_SYSCALL,
+    ASM_TEST,
+    ASM_XOR,
+};
+
+enum OperandKind {
+    OPERAND_NONE,
+    OPERAND_IMM,
+    OPERAND_LABEL,
+    OPERAND_MEM,
+    OPERAND_REG,
+};
+
+// all register and memory operands are 64 bits wide, except the destination of setcc which is the low byte
+struct Operand {
+    enum OperandKind kind;
+    union {
+        unsigned int reg;
+        int64_t imm;
+        unsigned int label;
+        struct {
+            unsigned int base;
+            int32_t disp;
+        } mem;
+    } data;
+};
+
+struct Instruction {
+    enum AsmOp op;
+    enum Condition cond; // only used by jcc and setcc
+    struct Operand operands[2];
+};
+
+struct Label {
+    const char* name;
+    int num; // local labels are printed as name.num, named labels have num = -1
+    bool global;
+};
+
+struct AsmFunction {
+    unsigned int label;
+    unsigned int end_label; // placed right after the last instruction
+    size_t begin; // instructions [begin, end) belong to the function
+    size_t end;
+    size_t frame_insn; // the prologue's sub rsp, or SIZE_MAX if it doesn't have one
+    unsigned int first_vreg; // the function uses virtual registers [first_vreg, end_vreg)
+    unsigned int end_vreg;
+};
+
+struct AsmBuffer {
+    struct dynarray instructions;
+    struct dynarray labels;
+    struct hashmap named_labels; // name -> label id
+    struct dynarray functions;
+    unsigned int vreg_count;
+};
+
+struct MachineCode {
+    struct dynarray bytes;
+    struct dynarray label_offsets; // size_t, indexed by label id
+};
+
+struct Operand Operand_reg(enum Register reg);
+struct Operand Operand_vreg(unsigned int vreg);
+struct Operand Operand_imm(int64_t imm);
+struct Operand Operand_mem(enum Register base, int32_t disp);
+struct Operand Operand_label(unsigned int label);
+
+void AsmBuffer_init(struct AsmBuffer* buf);
+void AsmBuffer_destroy(struct AsmBuffer* buf);
+unsigned int asm_named_label(struct AsmBuffer* buf, const char* name);
+unsigned int asm_local_label(struct AsmBuffer* buf, const char* name, int num);
+unsigned int asm_new_vreg(struct AsmBuffer* buf);
+void asm_emit0(struct AsmBuffer* buf, enum AsmOp op);
+void asm_emit1(struct AsmBuffer* buf, enum AsmOp op, struct Operand a);
+void asm_emit2(struct AsmBuffer* buf, enum AsmOp op, struct Operand dst, struct Operand src);
+void asm_emit_jcc(struct AsmBuffer* buf, enum Condition cond, unsigned int label);
+void asm_emit_setcc(struct AsmBuffer* buf, enum Condition cond, enum Register reg);
+void asm_emit_label(struct AsmBuffer* buf, unsigned int label);
+void asm_begin_function(struct AsmBuffer* buf, const char* name);
+void asm_end_function(struct AsmBuffer* buf);
+void asm_emit_frame_setup(struct AsmBuffer* buf, unsigned int frame_size);
+enum Condition invert_condition(enum Condition cond);
+
+/// Replace the virtual registers with physical ones, spilling to the stack frame when they run out
+void regalloc(struct AsmBuffer* buf);
+
+/// Rewrite short instruction sequences into cheaper ones, after register allocation
+void peephole(struct AsmBuffer* buf);
+/// Print how many times each peephole pattern matched so far
+void peephole_print_stats(FILE* fp);
+
+/// Print the buffer as NASM source
+void asm_print(const struct AsmBuffer* buf, FILE* fp);
+
+/// Encode the buffer into x86-64 machine code, resolving every jump and call
+void asm_encode(const struct AsmBuffer* buf, struct MachineCode* code);
+void MachineCode_destroy(struct MachineCode* code);
+
+/// Write the code as an ELF64 relocatable object with a .text section and a symbol per function
+void elf_write_object(FILE* fp, const struct AsmBuffer* buf, const struct MachineCode* code);
+
+/// Write the code as a static ELF64 executable whose entry point is _start, no linking needed
+void elf_write_executable(FILE* fp, const struct AsmBuffer* buf, const struct MachineCode* code);
+
+#endif //TOYCC_ASM_H
@@ -1,281 +1,378 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include "toycc.h"
+#include "asm.h"
+#include "ir.h"
 #include "util.h"
 
-const char* asm_preamble =
-        "global _start\n"
-        "section .text\n"
-        "_start:\n"
-        "mov rbp, rsp\n"
-        "call main\n"
-        "mov rdi, rax\n"
-        "mov rax, 60\n"
-        "syscall\n";
-
-void load_stack_loc_rax(size_t stack_loc, FILE* fp)
+struct Lowering {
+    struct AsmBuffer* buf;
+    unsigned int first_vreg; // IR value v lives in virtual register first_vreg + v
+    struct dynarray block_labels; // label id, indexed by block id
+};
+
+static struct Operand rax()
 {
-    fprintf(fp, "lea rax, [rbp-%lu]\n", stack_loc);
+    return Operand_reg(REG_RAX);
 }
 
-/// Write the address of the lvalue in rax
-void codegen_addr(struct ASTNode node, FILE* fp)
+/// _start calls main and passes its return value to the exit syscall
+void codegen_preamble(struct AsmBuffer* buf)
 {
-    switch(node.kind) {
-        case NODE_IDENT:
-            load_stack_loc_rax(node.data.decl.data.var.stack_loc, fp);
-            break;
+    asm_begin_function(buf, "_start");
+    struct Label* label = dynarray_get(&buf->labels, asm_named_label(buf, "_start"));
+    label->global = true;
+
+    asm_emit2(buf, ASM_MOV, Operand_reg(REG_RBP), Operand_reg(REG_RSP));
+    asm_emit1(buf, ASM_CALL, Operand_label(asm_named_label(buf, "main")));
+    asm_emit2(buf, ASM_MOV, Operand_reg(REG_RDI), rax());
+    asm_emit2(buf, ASM_MOV, rax(), Operand_imm(60));
+    asm_emit0(buf, ASM_SYSCALL);
+    asm_end_function(buf);
+}
 
-        default:
-            ASSERT(0 && "Unknown lvalue type");
-    }
+static struct Operand slot_operand(unsigned int slot)
+{
+    return Operand_mem(REG_RBP, -8 * (int32_t)(slot + 1));
 }
 
-void codegen_node(struct ASTNode node, FILE* fp);
+static struct Operand value_operand(struct Lowering* l, unsigned int value)
+{
+    return Operand_vreg(l->first_vreg + value);
+}
+
+static unsigned int block_label(struct Lowering* l, unsigned int block)
+{
+    return *(unsigned int*)dynarray_get(&l->block_labels, block);
+}
 
-void codegen_children(struct dynarray* children, FILE* fp)
+/// Copy an operand to a fresh virtual register unless it already is one
+static struct Operand to_reg(struct Operand op, struct AsmBuffer* buf)
 {
-    for (size_t i = 0; i < dynarray_length(children); i++)
-    {
-        struct ASTNode* child = dynarray_get(children, i);
-        codegen_node(*child, fp);
+    if (op.kind == OPERAND_REG) {
+        return op;
     }
+
+    struct Operand reg = Operand_vreg(asm_new_vreg(buf));
+    asm_emit2(buf, ASM_MOV, reg, op);
+    return reg;
 }
 
-/// the address of the lvalue must be in rax
-/// the value must be on top of the stack
-void codegen_assign(FILE* fp)
+/// Return the operand as a virtual register or, if it fits, a 32-bit immediate
+static struct Operand lower_operand(struct Lowering* l, struct IrOperand op)
 {
-    // copy from top of the stack to [rax] (address of the local variable)
-    // don't pop because assignment is an expression too
-    fprintf(fp, "mov rbx,[rsp]\n"
-                "mov [rax],rbx\n"
-                "sub rsp,8\n");
+    if (op.kind == IR_OPERAND_VALUE) {
+        return value_operand(l, op.data.value);
+    }
+
+    ASSERT(op.kind == IR_OPERAND_CONST)
+    // instructions only take sign-extended 32-bit immediates
+    if (op.data.imm >= INT32_MIN && op.data.imm <= INT32_MAX) {
+        return Operand_imm(op.data.imm);
+    } else {
+        return to_reg(Operand_imm(op.data.imm), l->buf);
+    }
 }
 
-void codegen_node(struct ASTNode node, FILE* fp)
+static struct Operand lower_reg(struct Lowering* l, struct IrOperand op)
 {
-    // it would be better to use an atomic if we ever want to multithread this
-    // but it is not in C99 and I want toycc to be able to compile itself. I might
-    // I decide to implement C11 atomics. For now, I don't plan to multithread toycc
-    // so this shouldn't be problematic
-    static unsigned int label_num = 0;
-
-    switch(node.kind) {
-        case NODE_ADD:
-            codegen_children(&node.children, fp);
-            fprintf(fp, "pop rbx\npop rax\nadd rax, rbx\npush rax\n");
-            break;
+    return to_reg(lower_operand(l, op), l->buf);
+}
 
-        case NODE_ASSIGN:
-        {
-            struct ASTNode* rhs = dynarray_get(&node.children, 1);
-            codegen_node(*rhs, fp);
+static void lower_epilogue(struct AsmBuffer* buf)
+{
+    asm_emit2(buf, ASM_MOV, Operand_reg(REG_RSP), Operand_reg(REG_RBP));
+    asm_emit1(buf, ASM_POP, Operand_reg(REG_RBP));
+    asm_emit0(buf, ASM_RET);
+}
 
-            struct ASTNode* lhs = dynarray_get(&node.children, 0);
-            codegen_addr(*lhs, fp);
+static enum Condition comparison_condition(enum IrOp op)
+{
+    switch(op) {
+        case IR_EQ:
+            return COND_E;
+        case IR_LT:
+            return COND_L;
+        case IR_NE:
+            return COND_NE;
+        default:
+            ASSERT(0 && "Not a comparison");
+    }
+    return COND_E;
+}
 
-            codegen_assign(fp);
-            break;
-        }
+static bool is_comparison(enum IrOp op)
+{
+    return op == IR_EQ || op == IR_LT || op == IR_NE;
+}
 
-        case NODE_ASSIGN_ADD:
-        {
-            struct ASTNode* lhs = dynarray_get(&node.children, 0);
-            struct ASTNode* rhs = dynarray_get(&node.children, 1);
+/// Set the flags for the comparison and return the condition that holds when it is true
+static enum Condition lower_compare(struct Lowering* l, const struct IrInst* cmp)
+{
+    struct Operand lhs = lower_reg(l, cmp->args[0]);
+    struct Operand rhs = lower_operand(l, cmp->args[1]);
+
+    // test sets the same flags as cmp with 0, with a shorter encoding
+    if (rhs.kind == OPERAND_IMM && rhs.data.imm == 0) {
+        asm_emit2(l->buf, ASM_TEST, lhs, lhs);
+    } else {
+        asm_emit2(l->buf, ASM_CMP, lhs, rhs);
+    }
+    return comparison_condition(cmp->op);
+}
 
-            codegen_node(*rhs, fp);
-            codegen_addr(*lhs, fp);
+/// Materialize the result of a comparison as 0 or 1
+static void lower_comparison(struct Lowering* l, const struct IrInst* inst)
+{
+    struct Operand dst = value_operand(l, inst->dst);
 
-            // the addition operand is at the top of the stack
-            // and the address of the lvalue is in rax
-            fprintf(fp, "pop rbx\n"
-                        "add [rax],rbx\n"
-                        "push qword [rax]\n");
-            break;
-        }
+    // clear the result before cmp, xor would overwrite the flags
+    asm_emit2(l->buf, ASM_XOR, dst, dst);
+    enum Condition cond = lower_compare(l, inst);
+    asm_emit_setcc(l->buf, cond, dst.data.reg);
+}
 
-        case NODE_BLOCK:
-            codegen_children(&node.children, fp);
-            break;
+/// Jump to the block unless it comes right after the current one
+static void lower_jump(struct Lowering* l, unsigned int target, unsigned int next_block)
+{
+    if (target != next_block) {
+        asm_emit1(l->buf, ASM_JMP, Operand_label(block_label(l, target)));
+    }
+}
 
-        case NODE_DECL:
-            // codegen the rhs
-            codegen_children(&node.children, fp);
-            // now the value is on top of the stack
+/// The flags are set, jump to if_true when cond holds and to if_false otherwise
+static void lower_branch(struct Lowering* l, enum Condition cond, unsigned int if_true, unsigned int if_false, unsigned int next_block)
+{
+    if (if_true == next_block) {
+        asm_emit_jcc(l->buf, invert_condition(cond), block_label(l, if_false));
+    } else {
+        asm_emit_jcc(l->buf, cond, block_label(l, if_true));
+        lower_jump(l, if_false, next_block);
+    }
+}
 
-            // we need to put the address of the lvalue in rax
-            load_stack_loc_rax(node.data.decl.data.var.stack_loc, fp);
+static void lower_inst(struct Lowering* l, const struct IrInst* inst, unsigned int next_block)
+{
+    struct AsmBuffer* buf = l->buf;
+    struct Operand dst = value_operand(l, inst->dst);
 
-            codegen_assign(fp);
+    switch(inst->op) {
+        case IR_ADD:
+            asm_emit2(buf, ASM_MOV, dst, lower_operand(l, inst->args[0]));
+            asm_emit2(buf, ASM_ADD, dst, lower_operand(l, inst->args[1]));
             break;
 
-        case NODE_DIV:
-            codegen_children(&node.children, fp);
-            fprintf(fp, "pop rbx\npop rax\nidiv rbx\npush rax\n");
+        case IR_BR:
+            lower_jump(l, inst->targets[0], next_block);
             break;
 
-        case NODE_EQUALS:
-            codegen_children(&node.children, fp);
-            fprintf(fp, "pop rcx\n"
-                        "pop rbx\n"
-                        "xor rax,rax\n"
-                        "cmp rbx,rcx\n"
-                        "sete al\n"
-                        "push rax\n");
+        case IR_CONDBR:
+        {
+            struct Operand cond = lower_reg(l, inst->args[0]);
+            asm_emit2(buf, ASM_TEST, cond, cond);
+            lower_branch(l, COND_NE, inst->targets[0], inst->targets[1], next_block);
             break;
+        }
 
-        case NODE_EXPR_STMT:
-            codegen_children(&node.children, fp);
-            fprintf(fp, "add rsp, 8\n");
+        case IR_COPY:
+        case IR_ZEXT:
+            // i1 values are already 0 or 1 in the whole register
+            asm_emit2(buf, ASM_MOV, dst, lower_operand(l, inst->args[0]));
             break;
 
-        case NODE_FOR:
+        case IR_DIV:
         {
-            unsigned int cur_label = label_num;
-            label_num++;
-
-            struct ASTNode* init = dynarray_get(&node.children, 0);
-            struct ASTNode* cond = dynarray_get(&node.children, 1);
-            struct ASTNode* increment = dynarray_get(&node.children, 2);
-            struct ASTNode* body = dynarray_get(&node.children, 3);
-
-            codegen_node(*init, fp);
-
-            fprintf(fp, "add rsp,8\n"
-                        "for.cond.%u:\n", cur_label);
-
-            codegen_node(*cond, fp);
-            fprintf(fp, "pop rax\n"
-                        "test rax,rax\n"
-                        "jz for.end.%u\n", cur_label);
-
-            codegen_node(*body, fp);
-            codegen_node(*increment, fp);
-            fprintf(fp, "add rsp,8\n"
-                        "jmp for.cond.%u\n"
-                        "for.end.%u:\n", cur_label, cur_label);
+            struct Operand divisor = lower_reg(l, inst->args[1]);
+            // idiv divides rdx:rax, which the allocator never hands out
+            asm_emit2(buf, ASM_MOV, rax(), lower_operand(l, inst->args[0]));
+            asm_emit0(buf, ASM_CQO);
+            asm_emit1(buf, ASM_IDIV, divisor);
+            asm_emit2(buf, ASM_MOV, dst, rax());
             break;
         }
 
-        case NODE_FUNCTION_DEF:
-            fprintf(fp, "%s:\n"
-                        "push rbp\n"
-                        "mov rbp, rsp\n"
-                        "sub rsp, %u\n", node.data.decl.ident, node.data.decl.data.fun.frame_size);
-            codegen_children(&node.children, fp);
-            fprintf(fp, "mov rsp, rbp\n"
-                        "pop rbp\n"
-                        "ret\n");
+        case IR_EQ:
+            lower_comparison(l, inst);
             break;
 
-        case NODE_IF:
-        {
-            unsigned int cur_label = label_num;
-            label_num++;
+        case IR_LOAD:
+            asm_emit2(buf, ASM_MOV, dst, slot_operand(inst->slot));
+            break;
 
-            struct ASTNode* cond = dynarray_get(&node.children, 0);
+        case IR_LT:
+            lower_comparison(l, inst);
+            break;
 
-            struct ASTNode* body = dynarray_get(&node.children, 1);
+        case IR_MUL:
+            asm_emit2(buf, ASM_MOV, dst, lower_operand(l, inst->args[0]));
+            asm_emit2(buf, ASM_IMUL, dst, lower_reg(l, inst->args[1]));
+            break;
 
-            codegen_node(*cond, fp);
+        case IR_NE:
+            lower_comparison(l, inst);
+            break;
 
-            fprintf(fp, "pop rax\ntest rax, rax\njz if.false.%u\n", cur_label);
+        case IR_RET:
+            asm_emit2(buf, ASM_MOV, rax(), lower_operand(l, inst->args[0]));
+            lower_epilogue(buf);
+            break;
 
-            codegen_node(*body, fp);
-            fprintf(fp, "jmp if.end.%u\n", cur_label);
+        case IR_STORE:
+            asm_emit2(buf, ASM_MOV, slot_operand(inst->slot), lower_operand(l, inst->args[0]));
+            break;
 
-            fprintf(fp, "if.false.%u:\n", cur_label);
+        case IR_SUB:
+            asm_emit2(buf, ASM_MOV, dst, lower_operand(l, inst->args[0]));
+            asm_emit2(buf, ASM_SUB, dst, lower_operand(l, inst->args[1]));
+            break;
+    }
+}
 
-            // else branch
-            if (dynarray_length(&node.children) == 3) {
-                struct ASTNode* else_body = dynarray_get(&node.children, 2);
-                codegen_node(*else_body, fp);
+/// The slots that promotion to SSA values left in memory
+static unsigned int frame_slot_count(const struct IrFunction* fun)
+{
+    unsigned int count = 0;
+    for (size_t b = 0; b < dynarray_length(&fun->blocks); b++) {
+        const struct IrBlock* block = IrFunction_block(fun, b);
+        for (size_t i = 0; i < dynarray_length(&block->insts); i++) {
+            const struct IrInst* inst = dynarray_get(&block->insts, i);
+            if ((inst->op == IR_LOAD || inst->op == IR_STORE) && inst->slot + 1 > count) {
+                count = inst->slot + 1;
             }
-
-            fprintf(fp, "if.end.%u:\n", cur_label);
-            break;
         }
+    }
+    return count;
+}
 
-        case NODE_IDENT:
-            codegen_children(&node.children, fp);
-            fprintf(fp, "push qword [rbp-%lu]\n", node.data.decl.data.var.stack_loc);
-            break;
+static unsigned int* count_uses(const struct IrFunction* fun)
+{
+    unsigned int* uses = calloc(fun->value_count, sizeof(unsigned int));
+    for (size_t b = 0; b < dynarray_length(&fun->blocks); b++) {
+        const struct IrBlock* block = IrFunction_block(fun, b);
+        for (size_t i = 0; i < dynarray_length(&block->insts); i++) {
+            const struct IrInst* inst = dynarray_get(&block->insts, i);
+            for (int a = 0; a < 2; a++) {
+                if (inst->args[a].kind == IR_OPERAND_VALUE) {
+                    uses[inst->args[a].data.value]++;
+                }
+            }
+        }
+    }
+    return uses;
+}
 
-        case NODE_INT:
-            codegen_children(&node.children, fp);
-            fprintf(fp, "push %ld\n", node.data.i64);
-            break;
+static bool writes_operand(const struct IrInst* inst, struct IrOperand op)
+{
+    return op.kind == IR_OPERAND_VALUE && ir_has_result(inst->op) && inst->dst == op.data.value;
+}
 
-        case NODE_LESS_THAN:
-            codegen_children(&node.children, fp);
-            fprintf(fp,"pop rcx\n"
-                       "pop rbx\n"
-                       "xor rax,rax\n"
-                       "cmp rbx,rcx\n"
-                       "setl al\n"
-                       "push rax\n");
-            break;
+/// Return the index of the comparison whose only use is the condbr ending the block, or SIZE_MAX.
+/// The comparison is emitted right before the branch, so only copies that don't write its
+/// operands can be in between, and they leave the flags alone
+static size_t fusable_comparison(const struct IrBlock* block, const unsigned int* uses)
+{
+    size_t len = dynarray_length(&block->insts);
+    const struct IrInst* term = dynarray_get(&block->insts, len-1);
+    if (term->op != IR_CONDBR || term->args[0].kind != IR_OPERAND_VALUE) {
+        return SIZE_MAX;
+    }
 
-        case NODE_MUL:
-            codegen_children(&node.children, fp);
-            fprintf(fp, "pop rbx\npop rax\nimul rax, rbx\npush rax\n");
-            break;
+    unsigned int cond = term->args[0].data.value;
+    for (size_t i = len-1; i-- > 0;) {
+        const struct IrInst* inst = dynarray_get(&block->insts, i);
+        if (is_comparison(inst->op) && inst->dst == cond) {
+            return (uses[cond] == 1) ? i : SIZE_MAX;
+        }
+        if (inst->op != IR_COPY) {
+            return SIZE_MAX;
+        }
+    }
+    return SIZE_MAX;
+}
 
-        case NODE_POSTFIX_INCREMENT:
-        {
-            struct ASTNode *operand = dynarray_get(&node.children, 0);
-            codegen_addr(*operand, fp);
-            fprintf(fp, "push qword [rax]\n"
-                        "inc qword [rax]\n");
-            break;
+/// Check that no copy between the comparison and the branch overwrites one of its operands
+static bool operands_survive(const struct IrBlock* block, size_t cmp)
+{
+    size_t len = dynarray_length(&block->insts);
+    const struct IrInst* cmp_inst = dynarray_get(&block->insts, cmp);
+    for (size_t i = cmp+1; i < len-1; i++) {
+        const struct IrInst* inst = dynarray_get(&block->insts, i);
+        if (writes_operand(inst, cmp_inst->args[0]) || writes_operand(inst, cmp_inst->args[1])) {
+            return false;
         }
+    }
+    return true;
+}
 
-        case NODE_PROGRAM:
-            ASSERT(0);
-            break;
+static void lower_function(const struct IrFunction* fun, struct AsmBuffer* buf)
+{
+    struct Lowering l;
+    l.buf = buf;
 
-        case NODE_RETURN:
-            codegen_children(&node.children, fp);
-            fprintf(fp, "pop rax\n"
-                        "mov rsp, rbp\n"
-                        "pop rbp\n"
-                        "ret\n");
-            break;
+    asm_begin_function(buf, fun->name);
+    asm_emit1(buf, ASM_PUSH, Operand_reg(REG_RBP));
+    asm_emit2(buf, ASM_MOV, Operand_reg(REG_RBP), Operand_reg(REG_RSP));
+    asm_emit_frame_setup(buf, 8 * frame_slot_count(fun));
 
-        case NODE_SUB:
-            codegen_children(&node.children, fp);
-            fprintf(fp, "pop rbx\npop rax\nsub rax, rbx\npush rax\n");
-            break;
+    l.first_vreg = buf->vreg_count;
+    for (unsigned int i = 0; i < fun->value_count; i++) {
+        asm_new_vreg(buf);
+    }
 
+    unsigned int* uses = count_uses(fun);
+    size_t block_count = dynarray_length(&fun->blocks);
+    dynarray_init(&l.block_labels, sizeof(unsigned int));
+    for (size_t i = 0; i < block_count; i++) {
+        // the label id makes the name unique across functions
+        unsigned int label = asm_local_label(buf, "bb", dynarray_length(&buf->labels));
+        dynarray_push(&l.block_labels, &label);
+    }
 
-        case NODE_WHILE:
-        {
-            unsigned int cur_label = label_num;
-            label_num++;
-            struct ASTNode* cond = dynarray_get(&node.children, 0);
-            struct ASTNode* body = dynarray_get(&node.children, 1);
+    for (size_t b = 0; b < block_count; b++) {
+        const struct IrBlock* block = IrFunction_block(fun, b);
+        unsigned int next_block = (b+1 < block_count) ? b+1 : UINT32_MAX;
 
-            fprintf(fp, "while.cond.%u:\n", cur_label);
-            codegen_node(*cond, fp);
+        ASSERT(dynarray_length(&block->phis) == 0 && "Phis must be removed before lowering")
+        asm_emit_label(buf, block_label(&l, b));
 
-            fprintf(fp, "pop rax\ntest rax,rax\njz while.end.%u\n", cur_label);
+        // a condition used only by the branch goes straight from cmp to jcc, without a 0/1 value
+        size_t len = dynarray_length(&block->insts);
+        size_t fused = fusable_comparison(block, uses);
+        if (fused != SIZE_MAX && !operands_survive(block, fused)) {
+            fused = SIZE_MAX;
+        }
 
-            codegen_node(*body, fp);
+        for (size_t i = 0; i < len; i++) {
+            const struct IrInst* inst = dynarray_get(&block->insts, i);
+            if (i == fused) {
+                continue;
+            }
 
-            fprintf(fp, "jmp while.cond.%u\nwhile.end.%u:\n", cur_label, cur_label);
-            break;
+            if (i == len-1 && fused != SIZE_MAX) {
+                enum Condition cond = lower_compare(&l, dynarray_get(&block->insts, fused));
+                lower_branch(&l, cond, inst->targets[0], inst->targets[1], next_block);
+            } else {
+                lower_inst(&l, inst, next_block);
+            }
         }
     }
+
+    free(uses);
+
+    asm_end_function(buf);
+    dynarray_destroy(&l.block_labels);
 }
 
-void codegen(struct ASTNode program, FILE* fp)
+void codegen(struct IrProgram* program, struct AsmBuffer* buf)
 {
-    fprintf(fp, "%s", asm_preamble);
+    codegen_preamble(buf);
 
-    for (size_t i = 0; i < dynarray_length(&program.children); i++)
-    {
-        fprintf(fp, "; statement %lu\n", i);
-        struct ASTNode* child = dynarray_get(&program.children, i);
-        codegen_node(*child, fp);
+    for (size_t i = 0; i < dynarray_length(&program->functions); i++) {
+        struct IrFunction* fun = dynarray_get(&program->functions, i);
+        ir_leave_ssa(fun);
+        lower_function(fun, buf);
     }
+
+    regalloc(buf);
+    peephole(buf);
 }
@@ -1,6 +1,7 @@
 #!/usr/bin/python3
 import sys
 import subprocess
+import tempfile
 from glob import glob
 
 exit_code = 0
@@ -17,23 +18,75 @@ for f in glob("tests/end2end/*.c"):
         print(f"Passed: {f}")
         continue
 
-    if subprocess.run(["nasm", "-felf64", "out.s"]).returncode != 0:
-        print(f"Error nasm: {f}")
+    ref_ret = subprocess.run(["./ref"]).returncode
+    out_ret = subprocess.run(["./out"]).returncode
+    if ref_ret != out_ret:
+        print(f"Error at runtime: {f}")
         exit_code = 1
         continue
 
-    if subprocess.run(["ld", "out.o", "-o", "out"]).returncode != 0:
-        print(f"Error ld: {f}")
+    jit_ret = subprocess.run(["./toycc", "--run", f], capture_output=True).returncode
+    if ref_ret != jit_ret:
+        print(f"Error in JIT mode: {f}")
         exit_code = 1
         continue
 
-    ref_ret = subprocess.run(["./ref"]).returncode
-    out_ret = subprocess.run(["./out"]).returncode
-    if ref_ret != out_ret:
-        print(f"Error at runtime: {f}")
+    # the IR doesn't depend on how the input was lexed
+    seq_ir = subprocess.run(["./toycc", "--emit=ir", "-o", "/dev/stdout", f], capture_output=True)
+    par_ir = subprocess.run(["./toycc", "--emit=ir", "--lex-threads=2", "-o", "/dev/stdout", f], capture_output=True)
+    if seq_ir.returncode != 0 or seq_ir.stdout != par_ir.stdout:
+        print(f"Error in --emit=ir or --lex-threads: {f}")
         exit_code = 1
         continue
 
     print(f"Passed: {f}")
 
+# the first line of each of these is "// error: <line>:<column>: <message>"
+for f in glob("tests/errors/*.c"):
+    with open(f) as fp:
+        expected = fp.readline().removeprefix("// error: ").strip()
+    for threads in ["1", "4", "8"]:
+        result = subprocess.run(["./toycc", f"--lex-threads={threads}", f], capture_output=True, text=True)
+        if result.returncode == 0 or result.stderr.strip() != f"{f}:{expected}":
+            print(f"Wrong error with --lex-threads={threads}: {f}: {result.stderr.strip()}")
+            exit_code = 1
+            break
+    else:
+        print(f"Passed: {f}")
+
+def large_program(error_lines):
+    """About 1 MB of statements and comments, so that --lex-threads splits it into several chunks"""
+    lines = ["int main() {", "    int x = 0;"]
+    for i in range(40000):
+        if i in error_lines:
+            lines.append(f"    x = {error_lines[i]};")
+        elif i % 3 == 0:
+            lines.append(f"    x = x + 0x{i:x}; // line {i}")
+        elif i % 3 == 1:
+            lines.append(f"    /* {i} {{ }} // */ x = x - {i} + 0b101;")
+        else:
+            lines.append(f"    x = x + 0{i:o}u * 2;")
+    lines.append("    return x;")
+    lines.append("}")
+    return "\n".join(lines) + "\n"
+
+# splitting the input must not change the tokens or which error is reported first
+with tempfile.TemporaryDirectory() as tmp:
+    for name, error_lines, first_error in [("large", {}, None),
+                                           ("large_errors", {15000: "1uu", 30000: "0x"}, b"1uu"),
+                                           ("large_parse_error", {10000: "x +", 30000: "0x"}, b"Expected int")]:
+        f = f"{tmp}/{name}.c"
+        with open(f, "w") as fp:
+            fp.write(large_program(error_lines))
+        outputs = [subprocess.run(["./toycc", f"--lex-threads={threads}", "--emit=ir", "-o", "/dev/stdout", f], capture_output=True)
+                   for threads in ["1", "3", "8"]]
+        if any(out.returncode != outputs[0].returncode or out.stdout != outputs[0].stdout or out.stderr != outputs[0].stderr for out in outputs):
+            print(f"Error with --lex-threads: {name}")
+            exit_code = 1
+        elif first_error is not None and first_error not in outputs[0].stderr:
+            print(f"Wrong first error: {name}: {outputs[0].stderr}")
+            exit_code = 1
+        else:
+            print(f"Passed: {name} with --lex-threads")
+
 sys.exit(exit_code)
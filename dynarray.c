@@ -48,6 +48,31 @@ void dynarray_push(struct dynarray* arr, void* x)
     arr->length++;
 }
 
+/// Push count elements at once
+void dynarray_append(struct dynarray* arr, const void* x, size_t count)
+{
+    if (count == 0) {
+        // an empty source array may have no data at all, which memcpy must not be given
+        return;
+    }
+    if (arr->length + count > arr->capacity) {
+        size_t capacity = (arr->capacity == 0) ? 2 : 2*arr->capacity;
+        while (capacity < arr->length + count) {
+            capacity *= 2;
+        }
+        arr->capacity = capacity;
+        arr->data = realloc(arr->data, arr->capacity*arr->element_size);
+
+        if (arr->data == NULL) {
+            fprintf(stderr, "Failed to grow dynamic array (realloc)\n");
+            exit(1);
+        }
+    }
+
+    memcpy(arr->data+arr->length*arr->element_size, x, count*arr->element_size);
+    arr->length += count;
+}
+
 void* dynarray_get(const struct dynarray* arr, size_t index)
 {
     ASSERT(index < arr->length)
@@ -16,6 +16,7 @@ void dynarray_init_with_capacity(struct dynarray* arr, size_t element_size, size
 void dynarray_init_with_length(struct dynarray* arr, size_t element_size, size_t length, void* x);
 void dynarray_destroy(struct dynarray* arr);
 void dynarray_push(struct dynarray* arr, void* x);
+void dynarray_append(struct dynarray* arr, const void* x, size_t count);
 void* dynarray_get(const struct dynarray* arr, size_t index);
 void dynarray_set(struct dynarray* arr, size_t index, void* x);
 size_t dynarray_length(const struct dynarray* arr);
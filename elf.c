@@ -0,0 +1,199 @@
+#include <elf.h>
+#include <stdio.h>
+#include <string.h>
+#include "asm.h"
+#include "util.h"
+
+enum {
+    SECTION_NULL,
+    SECTION_TEXT,
+    SECTION_SYMTAB,
+    SECTION_STRTAB,
+    SECTION_SHSTRTAB,
+    SECTION_COUNT,
+};
+
+static const char shstrtab[] = "\0.text\0.symtab\0.strtab\0.shstrtab";
+
+static void write_padding(FILE* fp, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        fputc(0, fp);
+    }
+}
+
+static size_t align(size_t offset, size_t alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+static void push_symbol(struct dynarray* symbols, struct dynarray* strtab, const char* name, unsigned char info, uint16_t section, size_t value)
+{
+    Elf64_Sym sym;
+    memset(&sym, 0, sizeof(sym));
+    sym.st_info = info;
+    sym.st_shndx = section;
+    sym.st_value = value;
+
+    if (name) {
+        sym.st_name = dynarray_length(strtab);
+        dynarray_append(strtab, name, strlen(name)+1);
+    }
+
+    dynarray_push(symbols, &sym);
+}
+
+/// Local symbols must come before the global ones, so this is called once for each binding
+static void push_function_symbols(struct dynarray* symbols, struct dynarray* strtab, const struct AsmBuffer* buf, const struct MachineCode* code, bool global)
+{
+    for (size_t i = 0; i < dynarray_length(&buf->functions); i++) {
+        const struct AsmFunction* fun = dynarray_get(&buf->functions, i);
+        const struct Label* label = dynarray_get(&buf->labels, fun->label);
+        if (label->global != global) {
+            continue;
+        }
+
+        size_t begin = *(size_t*)dynarray_get(&code->label_offsets, fun->label);
+        size_t end = *(size_t*)dynarray_get(&code->label_offsets, fun->end_label);
+        push_symbol(symbols, strtab, label->name, ELF64_ST_INFO(global ? STB_GLOBAL : STB_LOCAL, STT_FUNC), SECTION_TEXT, begin);
+
+        Elf64_Sym* sym = dynarray_get(symbols, dynarray_length(symbols)-1);
+        sym->st_size = end - begin;
+    }
+}
+
+void elf_write_object(FILE* fp, const struct AsmBuffer* buf, const struct MachineCode* code)
+{
+    struct dynarray strtab;
+    dynarray_init(&strtab, 1);
+    char null = 0;
+    dynarray_push(&strtab, &null);
+
+    struct dynarray symbols;
+    dynarray_init(&symbols, sizeof(Elf64_Sym));
+    push_symbol(&symbols, &strtab, NULL, ELF64_ST_INFO(STB_LOCAL, STT_NOTYPE), SHN_UNDEF, 0);
+    push_symbol(&symbols, &strtab, NULL, ELF64_ST_INFO(STB_LOCAL, STT_SECTION), SECTION_TEXT, 0);
+    push_function_symbols(&symbols, &strtab, buf, code, false);
+    size_t first_global = dynarray_length(&symbols);
+    push_function_symbols(&symbols, &strtab, buf, code, true);
+
+    size_t text_size = dynarray_length(&code->bytes);
+    size_t symtab_size = dynarray_length(&symbols) * sizeof(Elf64_Sym);
+    size_t strtab_size = dynarray_length(&strtab);
+
+    size_t text_offset = align(sizeof(Elf64_Ehdr), 16);
+    size_t symtab_offset = align(text_offset + text_size, 8);
+    size_t strtab_offset = symtab_offset + symtab_size;
+    size_t shstrtab_offset = strtab_offset + strtab_size;
+    size_t shdr_offset = align(shstrtab_offset + sizeof(shstrtab), 8);
+
+    Elf64_Ehdr ehdr;
+    memset(&ehdr, 0, sizeof(ehdr));
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    ehdr.e_type = ET_REL;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_shoff = shdr_offset;
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_shentsize = sizeof(Elf64_Shdr);
+    ehdr.e_shnum = SECTION_COUNT;
+    ehdr.e_shstrndx = SECTION_SHSTRTAB;
+
+    Elf64_Shdr shdrs[SECTION_COUNT];
+    memset(shdrs, 0, sizeof(shdrs));
+
+    shdrs[SECTION_TEXT].sh_name = 1;
+    shdrs[SECTION_TEXT].sh_type = SHT_PROGBITS;
+    shdrs[SECTION_TEXT].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+    shdrs[SECTION_TEXT].sh_offset = text_offset;
+    shdrs[SECTION_TEXT].sh_size = text_size;
+    shdrs[SECTION_TEXT].sh_addralign = 16;
+
+    shdrs[SECTION_SYMTAB].sh_name = 7;
+    shdrs[SECTION_SYMTAB].sh_type = SHT_SYMTAB;
+    shdrs[SECTION_SYMTAB].sh_offset = symtab_offset;
+    shdrs[SECTION_SYMTAB].sh_size = symtab_size;
+    shdrs[SECTION_SYMTAB].sh_link = SECTION_STRTAB;
+    shdrs[SECTION_SYMTAB].sh_info = first_global;
+    shdrs[SECTION_SYMTAB].sh_addralign = 8;
+    shdrs[SECTION_SYMTAB].sh_entsize = sizeof(Elf64_Sym);
+
+    shdrs[SECTION_STRTAB].sh_name = 15;
+    shdrs[SECTION_STRTAB].sh_type = SHT_STRTAB;
+    shdrs[SECTION_STRTAB].sh_offset = strtab_offset;
+    shdrs[SECTION_STRTAB].sh_size = strtab_size;
+    shdrs[SECTION_STRTAB].sh_addralign = 1;
+
+    shdrs[SECTION_SHSTRTAB].sh_name = 23;
+    shdrs[SECTION_SHSTRTAB].sh_type = SHT_STRTAB;
+    shdrs[SECTION_SHSTRTAB].sh_offset = shstrtab_offset;
+    shdrs[SECTION_SHSTRTAB].sh_size = sizeof(shstrtab);
+    shdrs[SECTION_SHSTRTAB].sh_addralign = 1;
+
+    fwrite(&ehdr, sizeof(ehdr), 1, fp);
+    write_padding(fp, text_offset - sizeof(ehdr));
+    fwrite(code->bytes.data, 1, text_size, fp);
+    write_padding(fp, symtab_offset - (text_offset + text_size));
+    fwrite(symbols.data, sizeof(Elf64_Sym), dynarray_length(&symbols), fp);
+    fwrite(strtab.data, 1, strtab_size, fp);
+    fwrite(shstrtab, 1, sizeof(shstrtab), fp);
+    write_padding(fp, shdr_offset - (shstrtab_offset + sizeof(shstrtab)));
+    fwrite(shdrs, sizeof(Elf64_Shdr), SECTION_COUNT, fp);
+
+    dynarray_destroy(&symbols);
+    dynarray_destroy(&strtab);
+}
+
+// same base address as ld uses for static executables
+static const Elf64_Addr load_address = 0x400000;
+
+void elf_write_executable(FILE* fp, const struct AsmBuffer* buf, const struct MachineCode* code)
+{
+    unsigned int start;
+    if (!hashmap_get(&buf->named_labels, "_start", &start)) {
+        fprintf(stderr, "No entry point\n");
+        exit(1);
+    }
+
+    // the headers and the code are mapped by a single segment starting at the beginning of the file
+    size_t text_offset = align(sizeof(Elf64_Ehdr) + sizeof(Elf64_Phdr), 16);
+    size_t text_size = dynarray_length(&code->bytes);
+    size_t start_offset = *(size_t*)dynarray_get(&code->label_offsets, start);
+
+    Elf64_Ehdr ehdr;
+    memset(&ehdr, 0, sizeof(ehdr));
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    ehdr.e_type = ET_EXEC;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_entry = load_address + text_offset + start_offset;
+    ehdr.e_phoff = sizeof(Elf64_Ehdr);
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_phentsize = sizeof(Elf64_Phdr);
+    ehdr.e_phnum = 1;
+    ehdr.e_shentsize = sizeof(Elf64_Shdr);
+
+    Elf64_Phdr phdr;
+    memset(&phdr, 0, sizeof(phdr));
+    phdr.p_type = PT_LOAD;
+    phdr.p_flags = PF_R | PF_X;
+    phdr.p_offset = 0;
+    phdr.p_vaddr = load_address;
+    phdr.p_paddr = load_address;
+    phdr.p_filesz = text_offset + text_size;
+    phdr.p_memsz = text_offset + text_size;
+    phdr.p_align = 0x1000;
+
+    fwrite(&ehdr, sizeof(ehdr), 1, fp);
+    fwrite(&phdr, sizeof(phdr), 1, fp);
+    write_padding(fp, text_offset - sizeof(ehdr) - sizeof(phdr));
+    fwrite(code->bytes.data, 1, text_size, fp);
+}
@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <string.h>
+#include "asm.h"
+#include "util.h"
+
+#define REX 0x40
+#define REX_W 0x48
+
+static const size_t undefined_offset = (size_t)-1;
+
+struct Fixup {
+    size_t offset; // position of the rel32 field
+    unsigned int label;
+};
+
+static bool fits_i8(int64_t v)
+{
+    return v >= INT8_MIN && v <= INT8_MAX;
+}
+
+static bool fits_i32(int64_t v)
+{
+    return v >= INT32_MIN && v <= INT32_MAX;
+}
+
+static void emit_byte(struct dynarray* bytes, uint8_t b)
+{
+    dynarray_push(bytes, &b);
+}
+
+static void emit_u32(struct dynarray* bytes, uint32_t v)
+{
+    uint8_t le[4];
+    for (int i = 0; i < 4; i++) {
+        le[i] = (v >> (8*i)) & 0xff;
+    }
+    dynarray_append(bytes, le, 4);
+}
+
+static void emit_u64(struct dynarray* bytes, uint64_t v)
+{
+    emit_u32(bytes, v & 0xffffffff);
+    emit_u32(bytes, v >> 32);
+}
+
+static void patch_u32(struct dynarray* bytes, size_t offset, uint32_t v)
+{
+    for (int i = 0; i < 4; i++) {
+        uint8_t b = (v >> (8*i)) & 0xff;
+        dynarray_set(bytes, offset+i, &b);
+    }
+}
+
+/// Emit an instruction taking a ModRM byte: the optional REX prefix, the opcode, then ModRM, SIB and displacement.
+/// reg is the register (or opcode extension) that goes in ModRM.reg and rm is a register or memory operand.
+/// rex is 0 when the prefix is only needed for extended registers, REX to force it or REX_W for 64-bit operands
+static void emit_modrm(struct dynarray* bytes, uint8_t rex, const char* opcode, unsigned int reg, struct Operand rm)
+{
+    ASSERT(rm.kind == OPERAND_REG || rm.kind == OPERAND_MEM)
+    unsigned int base = (rm.kind == OPERAND_REG) ? rm.data.reg : rm.data.mem.base;
+    ASSERT(!IS_VREG(reg) && !IS_VREG(base))
+
+    if (reg & 8) {
+        rex |= REX | 0x4;
+    }
+    if (base & 8) {
+        rex |= REX | 0x1;
+    }
+    if (rex) {
+        emit_byte(bytes, rex);
+    }
+    dynarray_append(bytes, opcode, strlen(opcode));
+
+    if (rm.kind == OPERAND_REG) {
+        emit_byte(bytes, 0xc0 | ((reg & 7) << 3) | (base & 7));
+        return;
+    }
+
+    // [rbp] and [r13] have no disp-less encoding, mod=00 with these bases means rip-relative
+    int32_t disp = rm.data.mem.disp;
+    uint8_t mod;
+    if (disp == 0 && (base & 7) != REG_RBP) {
+        mod = 0x00;
+    } else if (fits_i8(disp)) {
+        mod = 0x40;
+    } else {
+        mod = 0x80;
+    }
+
+    emit_byte(bytes, mod | ((reg & 7) << 3) | (base & 7));
+
+    // rsp and r12 as a base need a SIB byte with no index
+    if ((base & 7) == REG_RSP) {
+        emit_byte(bytes, 0x24);
+    }
+
+    if (mod == 0x40) {
+        emit_byte(bytes, (uint8_t)disp);
+    } else if (mod == 0x80) {
+        emit_u32(bytes, (uint32_t)disp);
+    }
+}
+
+/// Emit an opcode with the register number in its low 3 bits (push, pop, mov imm)
+static void emit_plus_reg(struct dynarray* bytes, uint8_t rex, uint8_t opcode, unsigned int reg)
+{
+    ASSERT(!IS_VREG(reg))
+    if (reg & 8) {
+        rex |= REX | 0x1;
+    }
+    if (rex) {
+        emit_byte(bytes, rex);
+    }
+    emit_byte(bytes, opcode + (reg & 7));
+}
+
+/// add, sub, cmp and xor share the same encoding scheme
+static void encode_alu(struct dynarray* bytes, const char* rm_r, const char* r_rm, unsigned int ext, struct Operand dst, struct Operand src)
+{
+    if (src.kind == OPERAND_IMM) {
+        if (fits_i8(src.data.imm)) {
+            emit_modrm(bytes, REX_W, "\x83", ext, dst);
+            emit_byte(bytes, (uint8_t)src.data.imm);
+        } else {
+            ASSERT(fits_i32(src.data.imm))
+            emit_modrm(bytes, REX_W, "\x81", ext, dst);
+            emit_u32(bytes, (uint32_t)src.data.imm);
+        }
+    } else if (src.kind == OPERAND_REG) {
+        emit_modrm(bytes, REX_W, rm_r, src.data.reg, dst);
+    } else {
+        ASSERT(dst.kind == OPERAND_REG)
+        emit_modrm(bytes, REX_W, r_rm, dst.data.reg, src);
+    }
+}
+
+static void encode_mov(struct dynarray* bytes, struct Operand dst, struct Operand src)
+{
+    if (src.kind == OPERAND_IMM) {
+        int64_t imm = src.data.imm;
+        if (dst.kind == OPERAND_REG && imm >= 0 && imm <= UINT32_MAX) {
+            // writing the 32-bit register zero-extends
+            emit_plus_reg(bytes, 0, 0xb8, dst.data.reg);
+            emit_u32(bytes, (uint32_t)imm);
+        } else if (fits_i32(imm)) {
+            emit_modrm(bytes, REX_W, "\xc7", 0, dst);
+            emit_u32(bytes, (uint32_t)imm);
+        } else {
+            ASSERT(dst.kind == OPERAND_REG)
+            emit_plus_reg(bytes, REX_W, 0xb8, dst.data.reg);
+            emit_u64(bytes, (uint64_t)imm);
+        }
+    } else if (src.kind == OPERAND_REG) {
+        emit_modrm(bytes, REX_W, "\x89", src.data.reg, dst);
+    } else {
+        ASSERT(dst.kind == OPERAND_REG)
+        emit_modrm(bytes, REX_W, "\x8b", dst.data.reg, src);
+    }
+}
+
+static void encode_rel32(struct dynarray* bytes, struct dynarray* fixups, const char* opcode, unsigned int label)
+{
+    dynarray_append(bytes, opcode, strlen(opcode));
+
+    struct Fixup fixup;
+    fixup.offset = dynarray_length(bytes);
+    fixup.label = label;
+    dynarray_push(fixups, &fixup);
+
+    emit_u32(bytes, 0);
+}
+
+void asm_encode(const struct AsmBuffer* buf, struct MachineCode* code)
+{
+    struct dynarray* bytes = &code->bytes;
+    dynarray_init(bytes, 1);
+    size_t undefined = undefined_offset;
+    dynarray_init_with_length(&code->label_offsets, sizeof(size_t), dynarray_length(&buf->labels), &undefined);
+
+    struct dynarray fixups;
+    dynarray_init(&fixups, sizeof(struct Fixup));
+
+    for (size_t i = 0; i < dynarray_length(&buf->instructions); i++) {
+        const struct Instruction* insn = dynarray_get(&buf->instructions, i);
+        struct Operand a = insn->operands[0];
+        struct Operand b = insn->operands[1];
+
+        switch(insn->op) {
+            case ASM_ADD:
+                encode_alu(bytes, "\x01", "\x03", 0, a, b);
+                break;
+
+            case ASM_CALL:
+                encode_rel32(bytes, &fixups, "\xe8", a.data.label);
+                break;
+
+            case ASM_CMP:
+                encode_alu(bytes, "\x39", "\x3b", 7, a, b);
+                break;
+
+            case ASM_CQO:
+                dynarray_append(bytes, "\x48\x99", 2);
+                break;
+
+            case ASM_IDIV:
+                emit_modrm(bytes, REX_W, "\xf7", 7, a);
+                break;
+
+            case ASM_IMUL:
+                ASSERT(a.kind == OPERAND_REG)
+                emit_modrm(bytes, REX_W, "\x0f\xaf", a.data.reg, b);
+                break;
+
+            case ASM_INC:
+                emit_modrm(bytes, REX_W, "\xff", 0, a);
+                break;
+
+            case ASM_JCC:
+            {
+                char opcode[] = { 0x0f, (char)(0x80 + insn->cond), 0 };
+                encode_rel32(bytes, &fixups, opcode, a.data.label);
+                break;
+            }
+
+            case ASM_JMP:
+                encode_rel32(bytes, &fixups, "\xe9", a.data.label);
+                break;
+
+            case ASM_LABEL:
+            {
+                size_t offset = dynarray_length(bytes);
+                dynarray_set(&code->label_offsets, a.data.label, &offset);
+                break;
+            }
+
+            case ASM_LEA:
+                ASSERT(a.kind == OPERAND_REG && b.kind == OPERAND_MEM)
+                emit_modrm(bytes, REX_W, "\x8d", a.data.reg, b);
+                break;
+
+            case ASM_MOV:
+                encode_mov(bytes, a, b);
+                break;
+
+            case ASM_POP:
+                if (a.kind == OPERAND_REG) {
+                    emit_plus_reg(bytes, 0, 0x58, a.data.reg);
+                } else {
+                    emit_modrm(bytes, 0, "\x8f", 0, a);
+                }
+                break;
+
+            case ASM_PUSH:
+                if (a.kind == OPERAND_REG) {
+                    emit_plus_reg(bytes, 0, 0x50, a.data.reg);
+                } else if (a.kind == OPERAND_IMM && fits_i8(a.data.imm)) {
+                    emit_byte(bytes, 0x6a);
+                    emit_byte(bytes, (uint8_t)a.data.imm);
+                } else if (a.kind == OPERAND_IMM) {
+                    ASSERT(fits_i32(a.data.imm))
+                    emit_byte(bytes, 0x68);
+                    emit_u32(bytes, (uint32_t)a.data.imm);
+                } else {
+                    emit_modrm(bytes, 0, "\xff", 6, a);
+                }
+                break;
+
+            case ASM_RET:
+                emit_byte(bytes, 0xc3);
+                break;
+
+            case ASM_SETCC:
+            {
+                // without a REX prefix, registers 4-7 would be ah, ch, dh and bh
+                uint8_t rex = (a.data.reg >= REG_RSP && a.data.reg <= REG_RDI) ? REX : 0;
+                char opcode[] = { 0x0f, (char)(0x90 + insn->cond), 0 };
+                emit_modrm(bytes, rex, opcode, 0, a);
+                break;
+            }
+
+            case ASM_SUB:
+                encode_alu(bytes, "\x29", "\x2b", 5, a, b);
+                break;
+
+            case ASM_SYSCALL:
+                dynarray_append(bytes, "\x0f\x05", 2);
+                break;
+
+            case ASM_TEST:
+                ASSERT(b.kind == OPERAND_REG)
+                emit_modrm(bytes, REX_W, "\x85", b.data.reg, a);
+                break;
+
+            case ASM_XOR:
+                encode_alu(bytes, "\x31", "\x33", 6, a, b);
+                break;
+        }
+    }
+
+    for (size_t i = 0; i < dynarray_length(&fixups); i++) {
+        struct Fixup* fixup = dynarray_get(&fixups, i);
+        size_t target = *(size_t*)dynarray_get(&code->label_offsets, fixup->label);
+        if (target == undefined_offset) {
+            const struct Label* label = dynarray_get(&buf->labels, fixup->label);
+            fprintf(stderr, "Undefined label: %s\n", label->name);
+            exit(1);
+        }
+
+        // relative to the end of the instruction, which is the end of the rel32 field
+        int64_t rel = (int64_t)target - (int64_t)(fixup->offset + 4);
+        patch_u32(bytes, fixup->offset, (uint32_t)rel);
+    }
+
+    dynarray_destroy(&fixups);
+}
+
+void MachineCode_destroy(struct MachineCode* code)
+{
+    dynarray_destroy(&code->bytes);
+    dynarray_destroy(&code->label_offsets);
+}
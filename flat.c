@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include "toycc.h"
+#include "util.h"
+
+static uint32_t count_nodes(const struct ASTNode* node)
+{
+    uint32_t count = 1;
+    for (uint32_t i = 0; i < node->child_count; i++) {
+        count += count_nodes(node->children[i]);
+    }
+    return count;
+}
+
+static bool assigns_variable(enum NodeKind kind)
+{
+    return kind == NODE_ASSIGN || kind == NODE_ASSIGN_ADD || kind == NODE_POSTFIX_INCREMENT;
+}
+
+static bool has_decl(enum NodeKind kind)
+{
+    return kind == NODE_DECL || kind == NODE_FUNCTION_DEF || kind == NODE_IDENT;
+}
+
+/// Append the subtree in post-order and return its size
+static uint32_t flatten(struct FlatAST* flat, const struct ASTNode* node)
+{
+    uint32_t first_child = 0;
+    int64_t data = 0;
+    if (node->kind == NODE_INT) {
+        data = node->data.i64;
+    } else if (has_decl(node->kind)) {
+        data = node->data.decl;
+    } else if (assigns_variable(node->kind)) {
+        // the variable becomes the node's operand, so that every node left in an expression is a value
+        ASSERT(node->children[0]->kind == NODE_IDENT)
+        data = node->children[0]->data.decl;
+        first_child = 1;
+    }
+
+    uint32_t size = 1;
+    for (uint32_t i = first_child; i < node->child_count; i++) {
+        size += flatten(flat, node->children[i]);
+    }
+
+    uint32_t index = flat->count++;
+    flat->kinds[index] = node->kind;
+    flat->child_counts[index] = node->child_count - first_child;
+    flat->sizes[index] = size;
+    flat->data[index] = data;
+    return size;
+}
+
+void FlatAST_init(struct FlatAST* flat, const struct ASTNode* root)
+{
+    uint32_t capacity = count_nodes(root);
+    flat->count = 0;
+    flat->kinds = malloc(capacity * sizeof(uint8_t));
+    flat->child_counts = malloc(capacity * sizeof(uint32_t));
+    flat->sizes = malloc(capacity * sizeof(uint32_t));
+    flat->data = malloc(capacity * sizeof(int64_t));
+    flatten(flat, root);
+}
+
+void FlatAST_destroy(struct FlatAST* flat)
+{
+    free(flat->kinds);
+    free(flat->child_counts);
+    free(flat->sizes);
+    free(flat->data);
+}
+
+void FlatAST_children(const struct FlatAST* flat, uint32_t node, uint32_t* children)
+{
+    // the last child comes right before its parent, and each sibling right before the subtree of the next
+    uint32_t child = node - 1;
+    for (uint32_t i = flat->child_counts[node]; i > 0; i--) {
+        children[i-1] = child;
+        child -= flat->sizes[child];
+    }
+}
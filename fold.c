@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "toycc.h"
+#include "util.h"
+
+static struct ASTNode* child(struct ASTNode* node, size_t i)
+{
+    return node->children[i];
+}
+
+static unsigned int count_nodes(const struct ASTNode* node)
+{
+    unsigned int count = 1;
+    for (uint32_t i = 0; i < node->child_count; i++) {
+        count += count_nodes(node->children[i]);
+    }
+    return count;
+}
+
+static bool is_int(const struct ASTNode* node, int64_t value)
+{
+    return node->kind == NODE_INT && node->data.i64 == value;
+}
+
+/// Expressions that can be dropped without changing the program
+static bool is_pure(const struct ASTNode* node)
+{
+    if (node->kind == NODE_ASSIGN || node->kind == NODE_ASSIGN_ADD || node->kind == NODE_POSTFIX_INCREMENT) {
+        return false;
+    }
+    // a division traps on a zero divisor and on INT64_MIN / -1, so only a constant divisor that is
+    // neither keeps it droppable
+    if (node->kind == NODE_DIV) {
+        const struct ASTNode* divisor = node->children[1];
+        if (divisor->kind != NODE_INT || divisor->data.i64 == 0 || divisor->data.i64 == -1) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < node->child_count; i++) {
+        if (!is_pure(node->children[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Replace the node with one of its children, or with a new leaf, and return how many nodes went away
+static unsigned int replace(struct ASTNode* node, struct ASTNode replacement)
+{
+    unsigned int removed = count_nodes(node) - count_nodes(&replacement);
+    *node = replacement;
+    return removed;
+}
+
+static unsigned int replace_with_int(struct ASTNode* node, int64_t value)
+{
+    struct ASTNode leaf;
+    ASTNode_init(&leaf, NODE_INT);
+    leaf.data.i64 = value;
+    return replace(node, leaf);
+}
+
+static unsigned int replace_with_empty_block(struct ASTNode* node)
+{
+    struct ASTNode block;
+    ASTNode_init(&block, NODE_BLOCK);
+    return replace(node, block);
+}
+
+/// Both operands are constants. The arithmetic wraps like the generated code does
+static bool fold_binary(enum NodeKind kind, int64_t a, int64_t b, int64_t* result)
+{
+    switch(kind) {
+        case NODE_ADD:
+            *result = (int64_t)((uint64_t)a + (uint64_t)b);
+            return true;
+
+        case NODE_SUB:
+            *result = (int64_t)((uint64_t)a - (uint64_t)b);
+            return true;
+
+        case NODE_MUL:
+            *result = (int64_t)((uint64_t)a * (uint64_t)b);
+            return true;
+
+        case NODE_DIV:
+            // leave the division to trap at runtime
+            if (b == 0 || (a == INT64_MIN && b == -1)) {
+                return false;
+            }
+            *result = a / b;
+            return true;
+
+        case NODE_EQUALS:
+            *result = a == b;
+            return true;
+
+        case NODE_LESS_THAN:
+            *result = a < b;
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static bool same_variable(const struct ASTNode* a, const struct ASTNode* b)
+{
+    return a->kind == NODE_IDENT && b->kind == NODE_IDENT
+        && a->data.decl == b->data.decl;
+}
+
+/// x+0, 0+x, x-0, x*1, 1*x, x/1, x*0, 0*x and x-x
+static unsigned int simplify_identity(struct ASTNode* node)
+{
+    struct ASTNode* lhs = child(node, 0);
+    struct ASTNode* rhs = child(node, 1);
+
+    switch(node->kind) {
+        case NODE_ADD:
+            if (is_int(rhs, 0)) {
+                return replace(node, *lhs);
+            } else if (is_int(lhs, 0)) {
+                return replace(node, *rhs);
+            }
+            break;
+
+        case NODE_SUB:
+            if (is_int(rhs, 0)) {
+                return replace(node, *lhs);
+            } else if (same_variable(lhs, rhs)) {
+                return replace_with_int(node, 0);
+            }
+            break;
+
+        case NODE_MUL:
+            if (is_int(rhs, 1)) {
+                return replace(node, *lhs);
+            } else if (is_int(lhs, 1)) {
+                return replace(node, *rhs);
+            } else if ((is_int(rhs, 0) && is_pure(lhs)) || (is_int(lhs, 0) && is_pure(rhs))) {
+                return replace_with_int(node, 0);
+            }
+            break;
+
+        case NODE_DIV:
+            if (is_int(rhs, 1)) {
+                return replace(node, *lhs);
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+unsigned int fold_constants(struct ASTNode* node)
+{
+    unsigned int removed = 0;
+    for (uint32_t i = 0; i < node->child_count; i++) {
+        removed += fold_constants(child(node, i));
+    }
+
+    switch(node->kind) {
+        case NODE_ADD:
+        case NODE_DIV:
+        case NODE_EQUALS:
+        case NODE_LESS_THAN:
+        case NODE_MUL:
+        case NODE_SUB:
+        {
+            struct ASTNode* lhs = child(node, 0);
+            struct ASTNode* rhs = child(node, 1);
+            int64_t result;
+            if (lhs->kind == NODE_INT && rhs->kind == NODE_INT && fold_binary(node->kind, lhs->data.i64, rhs->data.i64, &result)) {
+                removed += replace_with_int(node, result);
+            } else {
+                removed += simplify_identity(node);
+            }
+            break;
+        }
+
+        case NODE_BLOCK:
+        case NODE_FUNCTION_DEF:
+        {
+            // statements like "1;" or "x + 1;", which folding can leave behind, do nothing
+            uint32_t kept = 0;
+            for (uint32_t i = 0; i < node->child_count; i++) {
+                struct ASTNode* stmt = child(node, i);
+                if (stmt->kind == NODE_INT || (stmt->kind == NODE_EXPR_STMT && is_pure(stmt))) {
+                    removed += count_nodes(stmt);
+                } else {
+                    node->children[kept++] = stmt;
+                }
+            }
+            node->child_count = kept;
+            break;
+        }
+
+        case NODE_FOR:
+        {
+            // an empty condition is parsed as the constant 1, which irgen already turns into a plain
+            // jump. A condition that is always false leaves only the init clause
+            struct ASTNode* cond = child(node, 1);
+            if (is_int(cond, 0)) {
+                removed += replace(node, *child(node, 0));
+            }
+            break;
+        }
+
+        case NODE_IF:
+        {
+            struct ASTNode* cond = child(node, 0);
+            if (cond->kind != NODE_INT) {
+                break;
+            }
+
+            if (cond->data.i64 != 0) {
+                removed += replace(node, *child(node, 1));
+            } else if (node->child_count == 3) {
+                removed += replace(node, *child(node, 2));
+            } else {
+                removed += replace_with_empty_block(node);
+            }
+            break;
+        }
+
+        case NODE_WHILE:
+            if (is_int(child(node, 0), 0)) {
+                removed += replace_with_empty_block(node);
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return removed;
+}
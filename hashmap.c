@@ -12,6 +12,7 @@ void hashmap_init_ex(struct hashmap* map, size_t element_size, float load_factor
 {
     map->load_factor = load_factor;
     map->capacity = capacity;
+    map->count = 0;
     map->element_size = element_size;
     map->entries = calloc(capacity, sizeof(struct hashmap_entry));
 }
@@ -28,6 +29,28 @@ void hashmap_destroy(struct hashmap* map)
     free(map->entries);
 }
 
+/// Move the entries to a table twice as large, the keys and values are not copied
+static void grow(struct hashmap* map)
+{
+    struct hashmap_entry* old = map->entries;
+    size_t old_capacity = map->capacity;
+    map->capacity *= 2;
+    map->entries = calloc(map->capacity, sizeof(struct hashmap_entry));
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].key == NULL) {
+            continue;
+        }
+        uint64_t hash = XXH3_64bits(old[i].key, strlen(old[i].key));
+        size_t j = hash % map->capacity;
+        while (map->entries[j].key != NULL) {
+            j = (j + 1) % map->capacity;
+        }
+        map->entries[j] = old[i];
+    }
+    free(old);
+}
+
 void hashmap_set(struct hashmap* map, const char* key, const void* val)
 {
     size_t len_key = strlen(key);
@@ -36,18 +59,27 @@ void hashmap_set(struct hashmap* map, const char* key, const void* val)
     for (size_t i = 0; i < map->capacity; i++) {
         struct hashmap_entry* entry = &map->entries[(hash+i) % map->capacity];
         if (entry->key == NULL) {
-            entry->key = calloc(1, len_key+1);
-            memcpy(entry->key, key, len_key+1);
-            entry->value = calloc(1, map->element_size);
-            memcpy(entry->value, val, map->element_size);
-            return;
+            break;
         } else if (strcmp(entry->key, key) == 0) {
             memcpy(entry->value, val, map->element_size);
+            return;
         }
     }
 
-    fprintf(stderr, "Hashtable is full\n");
-    exit(1);
+    if (map->count + 1 > map->capacity * map->load_factor) {
+        grow(map);
+    }
+
+    size_t i = hash % map->capacity;
+    while (map->entries[i].key != NULL) {
+        i = (i + 1) % map->capacity;
+    }
+    struct hashmap_entry* entry = &map->entries[i];
+    entry->key = calloc(1, len_key+1);
+    memcpy(entry->key, key, len_key+1);
+    entry->value = calloc(1, map->element_size);
+    memcpy(entry->value, val, map->element_size);
+    map->count++;
 }
 
 bool hashmap_get(const struct hashmap* map, const char* key, void* val)
@@ -13,6 +13,7 @@ struct hashmap {
     struct hashmap_entry* entries;
     float load_factor;
     size_t capacity;
+    size_t count; // the table doubles when count would exceed capacity * load_factor
     size_t element_size;
 };
 
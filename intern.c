@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include "intern.h"
+#include "dynarray.h"
+#include "xxhash.h"
+#include "arena.h"
+
+struct InternEntry {
+    const char* string; // the NUL-terminated spelling, in the interner's arena
+    size_t len;
+    uint64_t hash; // kept so that growing the table doesn't hash again
+};
+
+struct Interner {
+    struct dynarray entries; // struct InternEntry, indexed by ID
+    unsigned int* slots; // ID+1, 0 for an empty slot
+    size_t capacity; // a power of two
+    struct Arena spellings; // lives as long as the process, like the IDs
+};
+
+// a single table for the whole compilation, so that IDs can be compared across scopes and files
+static struct Interner interner;
+
+static void interner_init()
+{
+    dynarray_init(&interner.entries, sizeof(struct InternEntry));
+    interner.capacity = 256;
+    interner.slots = calloc(interner.capacity, sizeof(unsigned int));
+    Arena_init(&interner.spellings);
+}
+
+static void grow()
+{
+    free(interner.slots);
+    interner.capacity *= 2;
+    interner.slots = calloc(interner.capacity, sizeof(unsigned int));
+
+    for (size_t id = 0; id < dynarray_length(&interner.entries); id++) {
+        const struct InternEntry* entry = dynarray_get(&interner.entries, id);
+        size_t i = entry->hash & (interner.capacity - 1);
+        while (interner.slots[i] != 0) {
+            i = (i + 1) & (interner.capacity - 1);
+        }
+        interner.slots[i] = id + 1;
+    }
+}
+
+static unsigned int intern_hashed(const char* str, size_t len, uint64_t hash)
+{
+    size_t i = hash & (interner.capacity - 1);
+    while (interner.slots[i] != 0) {
+        unsigned int id = interner.slots[i] - 1;
+        const struct InternEntry* entry = dynarray_get(&interner.entries, id);
+        if (entry->hash == hash && entry->len == len && memcmp(entry->string, str, len) == 0) {
+            return id;
+        }
+        i = (i + 1) & (interner.capacity - 1);
+    }
+
+    // copied so that the spelling doesn't depend on the lifetime of the buffer it came from, like an
+    // unmapped source file
+    char* copy = Arena_alloc(&interner.spellings, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = 0;
+
+    struct InternEntry entry;
+    entry.string = copy;
+    entry.len = len;
+    entry.hash = hash;
+    unsigned int id = dynarray_length(&interner.entries);
+    dynarray_push(&interner.entries, &entry);
+    interner.slots[i] = id + 1;
+
+    // keep the load factor under 1/2 so that probe sequences stay short
+    if (2 * dynarray_length(&interner.entries) > interner.capacity) {
+        grow();
+    }
+
+    return id;
+}
+
+static void ensure_init()
+{
+    if (!interner.slots) {
+        interner_init();
+    }
+}
+
+unsigned int intern(const char* str, size_t len)
+{
+    ensure_init();
+    return intern_hashed(str, len, XXH3_64bits(str, len));
+}
+
+const char* intern_string(unsigned int id)
+{
+    ensure_init();
+    const struct InternEntry* entry = dynarray_get(&interner.entries, id);
+    return entry->string;
+}
+
+size_t intern_count(void)
+{
+    ensure_init();
+    return dynarray_length(&interner.entries);
+}
@@ -0,0 +1,16 @@
+#ifndef TOYCC_INTERN_H
+#define TOYCC_INTERN_H
+#include <stdlib.h>
+#include <stdint.h>
+
+/// Return the ID of the spelling, adding it to the table if it is new. IDs are dense and start at 0.
+/// str only has to be valid during the call: a new spelling is copied once into an arena owned by the
+/// table, and a spelling that is already known is not copied at all
+unsigned int intern(const char* str, size_t len);
+
+/// The canonical NUL-terminated copy of the spelling, the same pointer for every lookup of the ID
+const char* intern_string(unsigned int id);
+
+size_t intern_count(void);
+
+#endif //TOYCC_INTERN_H
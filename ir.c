@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include "ir.h"
+#include "util.h"
+
+struct IrOperand IrOperand_const(int64_t imm)
+{
+    struct IrOperand op;
+    op.kind = IR_OPERAND_CONST;
+    op.data.imm = imm;
+    return op;
+}
+
+struct IrOperand IrOperand_value(unsigned int value)
+{
+    struct IrOperand op;
+    op.kind = IR_OPERAND_VALUE;
+    op.data.value = value;
+    return op;
+}
+
+void IrInst_init(struct IrInst* inst, enum IrOp op)
+{
+    inst->op = op;
+    inst->type = IR_I64;
+    inst->dst = 0;
+    inst->args[0].kind = IR_OPERAND_NONE;
+    inst->args[1].kind = IR_OPERAND_NONE;
+    inst->slot = 0;
+    inst->targets[0] = 0;
+    inst->targets[1] = 0;
+}
+
+void IrFunction_init(struct IrFunction* fun, const char* name, unsigned int slot_count)
+{
+    fun->name = name;
+    dynarray_init(&fun->blocks, sizeof(struct IrBlock));
+    const char* no_name = NULL;
+    dynarray_init_with_length(&fun->slot_names, sizeof(const char*), slot_count, &no_name);
+    fun->value_count = 0;
+}
+
+unsigned int IrFunction_new_block(struct IrFunction* fun)
+{
+    struct IrBlock block;
+    block.id = dynarray_length(&fun->blocks);
+    dynarray_init(&block.phis, sizeof(struct IrPhi));
+    dynarray_init(&block.insts, sizeof(struct IrInst));
+    dynarray_push(&fun->blocks, &block);
+    return block.id;
+}
+
+struct IrBlock* IrFunction_block(const struct IrFunction* fun, unsigned int id)
+{
+    return dynarray_get(&fun->blocks, id);
+}
+
+void IrProgram_destroy(struct IrProgram* program)
+{
+    for (size_t f = 0; f < dynarray_length(&program->functions); f++) {
+        struct IrFunction* fun = dynarray_get(&program->functions, f);
+        for (size_t b = 0; b < dynarray_length(&fun->blocks); b++) {
+            struct IrBlock* block = dynarray_get(&fun->blocks, b);
+            for (size_t i = 0; i < dynarray_length(&block->phis); i++) {
+                struct IrPhi* phi = dynarray_get(&block->phis, i);
+                dynarray_destroy(&phi->args);
+            }
+            dynarray_destroy(&block->phis);
+            dynarray_destroy(&block->insts);
+        }
+        dynarray_destroy(&fun->blocks);
+        dynarray_destroy(&fun->slot_names);
+    }
+    dynarray_destroy(&program->functions);
+}
+
+bool ir_is_terminator(enum IrOp op)
+{
+    return op == IR_BR || op == IR_CONDBR || op == IR_RET;
+}
+
+bool ir_has_result(enum IrOp op)
+{
+    return !ir_is_terminator(op) && op != IR_STORE;
+}
+
+unsigned int ir_successors(const struct IrBlock* block, unsigned int succ[2])
+{
+    size_t len = dynarray_length(&block->insts);
+    ASSERT(len > 0)
+    const struct IrInst* term = dynarray_get(&block->insts, len-1);
+
+    switch(term->op) {
+        case IR_BR:
+            succ[0] = term->targets[0];
+            return 1;
+
+        case IR_CONDBR:
+            succ[0] = term->targets[0];
+            succ[1] = term->targets[1];
+            return 2;
+
+        case IR_RET:
+            return 0;
+
+        default:
+            ASSERT(0 && "Block without a terminator");
+    }
+
+    return 0;
+}
+
+static const char* op_name(enum IrOp op)
+{
+    switch(op) {
+        case IR_ADD:
+            return "add";
+        case IR_BR:
+            return "br";
+        case IR_CONDBR:
+            return "condbr";
+        case IR_COPY:
+            return "copy";
+        case IR_DIV:
+            return "div";
+        case IR_EQ:
+            return "eq";
+        case IR_LOAD:
+            return "load";
+        case IR_LT:
+            return "lt";
+        case IR_MUL:
+            return "mul";
+        case IR_NE:
+            return "ne";
+        case IR_RET:
+            return "ret";
+        case IR_STORE:
+            return "store";
+        case IR_SUB:
+            return "sub";
+        case IR_ZEXT:
+            return "zext";
+    }
+
+    ASSERT(0 && "Unknown IR opcode");
+    return NULL;
+}
+
+static void print_operand(struct IrOperand op, FILE* fp)
+{
+    switch(op.kind) {
+        case IR_OPERAND_NONE:
+            break;
+
+        case IR_OPERAND_CONST:
+            fprintf(fp, "%ld", op.data.imm);
+            break;
+
+        case IR_OPERAND_VALUE:
+            fprintf(fp, "%%%u", op.data.value);
+            break;
+    }
+}
+
+static void print_slot(const struct IrFunction* fun, unsigned int slot, FILE* fp)
+{
+    const char* name = *(const char**)dynarray_get(&fun->slot_names, slot);
+    if (name) {
+        fprintf(fp, "$%s", name);
+    } else {
+        fprintf(fp, "$%u", slot);
+    }
+}
+
+static void print_inst(const struct IrFunction* fun, const struct IrInst* inst, FILE* fp)
+{
+    fprintf(fp, "    ");
+    if (ir_has_result(inst->op)) {
+        fprintf(fp, "%%%u:%s = ", inst->dst, inst->type == IR_I1 ? "i1" : "i64");
+    }
+    fprintf(fp, "%s", op_name(inst->op));
+
+    const char* sep = " ";
+    if (inst->op == IR_LOAD || inst->op == IR_STORE) {
+        fprintf(fp, " ");
+        print_slot(fun, inst->slot, fp);
+        sep = ", ";
+    }
+
+    for (int i = 0; i < 2 && inst->args[i].kind != IR_OPERAND_NONE; i++) {
+        fprintf(fp, "%s", sep);
+        print_operand(inst->args[i], fp);
+        sep = ", ";
+    }
+
+    if (inst->op == IR_BR) {
+        fprintf(fp, " bb%u", inst->targets[0]);
+    } else if (inst->op == IR_CONDBR) {
+        fprintf(fp, ", bb%u, bb%u", inst->targets[0], inst->targets[1]);
+    }
+
+    fprintf(fp, "\n");
+}
+
+static void print_phi(const struct IrFunction* fun, const struct IrPhi* phi, FILE* fp)
+{
+    fprintf(fp, "    %%%u:i64 = phi", phi->dst);
+    for (size_t i = 0; i < dynarray_length(&phi->args); i++) {
+        const struct IrPhiArg* arg = dynarray_get(&phi->args, i);
+        fprintf(fp, "%s [", i == 0 ? "" : ",");
+        print_operand(arg->value, fp);
+        fprintf(fp, ", bb%u]", arg->block);
+    }
+    fprintf(fp, " ; ");
+    print_slot(fun, phi->slot, fp);
+    fprintf(fp, "\n");
+}
+
+void ir_print(const struct IrProgram* program, FILE* fp)
+{
+    for (size_t f = 0; f < dynarray_length(&program->functions); f++) {
+        const struct IrFunction* fun = dynarray_get(&program->functions, f);
+        fprintf(fp, "function %s {\n", fun->name);
+
+        for (size_t b = 0; b < dynarray_length(&fun->blocks); b++) {
+            const struct IrBlock* block = dynarray_get(&fun->blocks, b);
+            fprintf(fp, "bb%u:\n", block->id);
+            for (size_t i = 0; i < dynarray_length(&block->phis); i++) {
+                print_phi(fun, dynarray_get(&block->phis, i), fp);
+            }
+            for (size_t i = 0; i < dynarray_length(&block->insts); i++) {
+                print_inst(fun, dynarray_get(&block->insts, i), fp);
+            }
+        }
+
+        fprintf(fp, "}\n");
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef TOYCC_IR_H
+#define TOYCC_IR_H
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "dynarray.h"
+
+enum IrType {
+    IR_I1,  // result of a comparison, 0 or 1
+    IR_I64,
+};
+
+enum IrOp {
+    IR_ADD,
+    IR_BR,      // unconditional jump to targets[0]
+    IR_CONDBR,  // jump to targets[0] if args[0] is 1, targets[1] otherwise
+    IR_COPY,
+    IR_DIV,
+    IR_EQ,
+    IR_LOAD,    // read the local variable in slot
+    IR_LT,
+    IR_MUL,
+    IR_NE,
+    IR_RET,
+    IR_STORE,   // write args[0] to the local variable in slot
+    IR_SUB,
+    IR_ZEXT,    // i1 -> i64
+};
+
+enum IrOperandKind {
+    IR_OPERAND_NONE,
+    IR_OPERAND_CONST,
+    IR_OPERAND_VALUE,
+};
+
+struct IrOperand {
+    enum IrOperandKind kind;
+    union {
+        int64_t imm;
+        unsigned int value;
+    } data;
+};
+
+struct IrInst {
+    enum IrOp op;
+    enum IrType type; // type of the result
+    unsigned int dst; // result value, only for the instructions that have one
+    struct IrOperand args[2];
+    unsigned int slot;
+    unsigned int targets[2]; // block ids
+};
+
+struct IrPhiArg {
+    unsigned int block; // the predecessor the value comes from
+    struct IrOperand value;
+};
+
+struct IrPhi {
+    unsigned int dst;
+    unsigned int slot; // the local variable it was created for
+    struct dynarray args; // struct IrPhiArg
+};
+
+struct IrBlock {
+    unsigned int id; // also the index in the function's blocks
+    struct dynarray phis; // struct IrPhi, all i64 and evaluated at the start of the block
+    struct dynarray insts; // the last one is a terminator: br, condbr or ret
+};
+
+struct IrFunction {
+    const char* name;
+    struct dynarray blocks;
+    struct dynarray slot_names; // const char*, one 8-byte local variable per slot
+    unsigned int value_count;
+};
+
+struct IrProgram {
+    struct dynarray functions;
+};
+
+struct IrOperand IrOperand_const(int64_t imm);
+struct IrOperand IrOperand_value(unsigned int value);
+
+void IrInst_init(struct IrInst* inst, enum IrOp op);
+void IrFunction_init(struct IrFunction* fun, const char* name, unsigned int slot_count);
+unsigned int IrFunction_new_block(struct IrFunction* fun);
+struct IrBlock* IrFunction_block(const struct IrFunction* fun, unsigned int id);
+void IrProgram_destroy(struct IrProgram* program);
+
+bool ir_is_terminator(enum IrOp op);
+bool ir_has_result(enum IrOp op);
+/// Store the targets of the block's terminator in succ and return how many there are
+unsigned int ir_successors(const struct IrBlock* block, unsigned int succ[2]);
+
+/// Promote the local variables to SSA values, with phis at the dominance frontiers of their stores.
+/// Unreachable blocks are removed first
+void ir_mem2reg(struct IrFunction* fun);
+
+/// Replace the phis with copies in the predecessors
+void ir_leave_ssa(struct IrFunction* fun);
+
+/// Print the program in a readable form
+void ir_print(const struct IrProgram* program, FILE* fp);
+
+#endif //TOYCC_IR_H
@@ -0,0 +1,416 @@
+#include <stdio.h>
+#include "toycc.h"
+#include "ir.h"
+#include "util.h"
+
+struct IrBuilder {
+    struct IrFunction* fun;
+    unsigned int block; // instructions are appended to this block
+    const struct SymbolTable* symbols;
+    const struct FlatAST* ast;
+    struct dynarray values; // struct IrOperand, the operand stack of scan_expr
+    struct dynarray children; // uint32_t, the children of the blocks being generated
+};
+
+static uint32_t decl_of(struct IrBuilder* b, uint32_t node)
+{
+    return (uint32_t)b->ast->data[node];
+}
+
+/// Locals live at [rbp-stack_loc], the first one has stack_loc = 8
+static unsigned int slot_of(struct IrBuilder* b, uint32_t node)
+{
+    return SymbolTable_get(b->symbols, decl_of(b, node))->data.var.stack_loc / 8 - 1;
+}
+
+static bool is_terminated(struct IrBuilder* b)
+{
+    struct IrBlock* block = IrFunction_block(b->fun, b->block);
+    size_t len = dynarray_length(&block->insts);
+    return len > 0 && ir_is_terminator(((struct IrInst*)dynarray_get(&block->insts, len-1))->op);
+}
+
+static void push_inst(struct IrBuilder* b, struct IrInst* inst)
+{
+    ASSERT(!is_terminated(b))
+    if (ir_has_result(inst->op)) {
+        inst->dst = b->fun->value_count++;
+    }
+    dynarray_push(&IrFunction_block(b->fun, b->block)->insts, inst);
+}
+
+static struct IrOperand emit(struct IrBuilder* b, enum IrOp op, enum IrType type, struct IrOperand lhs, struct IrOperand rhs)
+{
+    struct IrInst inst;
+    IrInst_init(&inst, op);
+    inst.type = type;
+    inst.args[0] = lhs;
+    inst.args[1] = rhs;
+    push_inst(b, &inst);
+    return IrOperand_value(inst.dst);
+}
+
+static struct IrOperand emit_load(struct IrBuilder* b, unsigned int slot)
+{
+    struct IrInst inst;
+    IrInst_init(&inst, IR_LOAD);
+    inst.slot = slot;
+    push_inst(b, &inst);
+    return IrOperand_value(inst.dst);
+}
+
+static void emit_store(struct IrBuilder* b, unsigned int slot, struct IrOperand value)
+{
+    struct IrInst inst;
+    IrInst_init(&inst, IR_STORE);
+    inst.slot = slot;
+    inst.args[0] = value;
+    push_inst(b, &inst);
+}
+
+static void emit_br(struct IrBuilder* b, unsigned int target)
+{
+    struct IrInst inst;
+    IrInst_init(&inst, IR_BR);
+    inst.targets[0] = target;
+    push_inst(b, &inst);
+}
+
+/// Jump to if_true when cond is 1, if_false otherwise
+static void emit_condbr(struct IrBuilder* b, struct IrOperand cond, unsigned int if_true, unsigned int if_false)
+{
+    if (cond.kind == IR_OPERAND_CONST) {
+        emit_br(b, cond.data.imm ? if_true : if_false);
+        return;
+    }
+
+    struct IrInst inst;
+    IrInst_init(&inst, IR_CONDBR);
+    inst.args[0] = cond;
+    inst.targets[0] = if_true;
+    inst.targets[1] = if_false;
+    push_inst(b, &inst);
+}
+
+static void emit_ret(struct IrBuilder* b, struct IrOperand value)
+{
+    struct IrInst inst;
+    IrInst_init(&inst, IR_RET);
+    inst.args[0] = value;
+    push_inst(b, &inst);
+}
+
+static void push_value(struct IrBuilder* b, struct IrOperand value)
+{
+    dynarray_push(&b->values, &value);
+}
+
+static struct IrOperand pop_value(struct IrBuilder* b)
+{
+    struct IrOperand value = *(struct IrOperand*)dynarray_get(&b->values, dynarray_length(&b->values) - 1);
+    dynarray_pop(&b->values);
+    return value;
+}
+
+static struct IrOperand emit_binary(struct IrBuilder* b, enum IrOp op, enum IrType type)
+{
+    struct IrOperand rhs = pop_value(b);
+    struct IrOperand lhs = pop_value(b);
+    return emit(b, op, type, lhs, rhs);
+}
+
+/// Push the i64 value of each node in [first, last], which holds whole expressions in post-order
+static void scan_expr(struct IrBuilder* b, uint32_t first, uint32_t last)
+{
+    struct IrOperand none;
+    none.kind = IR_OPERAND_NONE;
+
+    for (uint32_t node = first; node <= last; node++) {
+        struct IrOperand value;
+        switch(b->ast->kinds[node]) {
+            case NODE_ADD:
+                value = emit_binary(b, IR_ADD, IR_I64);
+                break;
+
+            case NODE_ASSIGN:
+                value = pop_value(b);
+                emit_store(b, slot_of(b, node), value);
+                break;
+
+            case NODE_ASSIGN_ADD:
+            {
+                unsigned int slot = slot_of(b, node);
+                struct IrOperand rhs = pop_value(b);
+                value = emit(b, IR_ADD, IR_I64, emit_load(b, slot), rhs);
+                emit_store(b, slot, value);
+                break;
+            }
+
+            case NODE_DIV:
+                value = emit_binary(b, IR_DIV, IR_I64);
+                break;
+
+            case NODE_EQUALS:
+                value = emit(b, IR_ZEXT, IR_I64, emit_binary(b, IR_EQ, IR_I1), none);
+                break;
+
+            case NODE_IDENT:
+                value = emit_load(b, slot_of(b, node));
+                break;
+
+            case NODE_INT:
+                value = IrOperand_const(b->ast->data[node]);
+                break;
+
+            case NODE_LESS_THAN:
+                value = emit(b, IR_ZEXT, IR_I64, emit_binary(b, IR_LT, IR_I1), none);
+                break;
+
+            case NODE_MUL:
+                value = emit_binary(b, IR_MUL, IR_I64);
+                break;
+
+            case NODE_POSTFIX_INCREMENT:
+            {
+                unsigned int slot = slot_of(b, node);
+                value = emit_load(b, slot);
+                emit_store(b, slot, emit(b, IR_ADD, IR_I64, value, IrOperand_const(1)));
+                break;
+            }
+
+            case NODE_SUB:
+                value = emit_binary(b, IR_SUB, IR_I64);
+                break;
+
+            default:
+                ASSERT(0 && "Not an expression");
+                value = none;
+                break;
+        }
+        push_value(b, value);
+    }
+}
+
+static uint32_t first_of(struct IrBuilder* b, uint32_t node)
+{
+    return node - b->ast->sizes[node] + 1;
+}
+
+/// Return the i64 value of the expression
+static struct IrOperand irgen_expr(struct IrBuilder* b, uint32_t node)
+{
+    scan_expr(b, first_of(b, node), node);
+    return pop_value(b);
+}
+
+/// Return an i1 operand, 1 if the expression is nonzero
+static struct IrOperand irgen_cond(struct IrBuilder* b, uint32_t node)
+{
+    switch(b->ast->kinds[node]) {
+        case NODE_EQUALS:
+            scan_expr(b, first_of(b, node), node - 1);
+            return emit_binary(b, IR_EQ, IR_I1);
+
+        case NODE_LESS_THAN:
+            scan_expr(b, first_of(b, node), node - 1);
+            return emit_binary(b, IR_LT, IR_I1);
+
+        case NODE_INT:
+            return IrOperand_const(b->ast->data[node] != 0);
+
+        default:
+            return emit(b, IR_NE, IR_I1, irgen_expr(b, node), IrOperand_const(0));
+    }
+}
+
+static void irgen_node(struct IrBuilder* b, uint32_t node);
+
+static void irgen_children(struct IrBuilder* b, uint32_t node)
+{
+    // the siblings are found from the last one back, each subtree ends right before the next one.
+    // They are collected on a stack shared by the nested blocks, so that nothing is allocated per block
+    uint32_t count = b->ast->child_counts[node];
+    size_t base = dynarray_length(&b->children);
+    uint32_t child = node - 1;
+    for (uint32_t i = 0; i < count; i++) {
+        dynarray_push(&b->children, &child);
+    }
+    for (uint32_t i = count; i > 0; i--) {
+        dynarray_set(&b->children, base + i - 1, &child);
+        child -= b->ast->sizes[child];
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        irgen_node(b, *(uint32_t*)dynarray_get(&b->children, base + i));
+    }
+
+    while (dynarray_length(&b->children) > base) {
+        dynarray_pop(&b->children);
+    }
+}
+
+/// Generate a statement, or an expression whose value is discarded
+static void irgen_node(struct IrBuilder* b, uint32_t node)
+{
+    // code following a return is unreachable, but it still needs a block to go in
+    if (is_terminated(b)) {
+        b->block = IrFunction_new_block(b->fun);
+    }
+
+    // statements have at most 4 children, blocks go through irgen_children
+    uint32_t children[4];
+
+    switch(b->ast->kinds[node]) {
+        case NODE_BLOCK:
+        case NODE_EXPR_STMT:
+            irgen_children(b, node);
+            break;
+
+        case NODE_DECL:
+        {
+            const char* name = SymbolTable_get(b->symbols, decl_of(b, node))->ident;
+            dynarray_set(&b->fun->slot_names, slot_of(b, node), &name);
+            if (b->ast->child_counts[node] > 0) {
+                emit_store(b, slot_of(b, node), irgen_expr(b, node - 1));
+            }
+            break;
+        }
+
+        case NODE_FOR:
+        {
+            FlatAST_children(b->ast, node, children);
+            unsigned int cond_block = IrFunction_new_block(b->fun);
+            unsigned int body_block = IrFunction_new_block(b->fun);
+            unsigned int end_block = IrFunction_new_block(b->fun);
+
+            irgen_node(b, children[0]);
+            emit_br(b, cond_block);
+
+            b->block = cond_block;
+            emit_condbr(b, irgen_cond(b, children[1]), body_block, end_block);
+
+            b->block = body_block;
+            irgen_node(b, children[3]);
+            irgen_node(b, children[2]);
+            emit_br(b, cond_block);
+
+            b->block = end_block;
+            break;
+        }
+
+        case NODE_IF:
+        {
+            FlatAST_children(b->ast, node, children);
+            unsigned int then_block = IrFunction_new_block(b->fun);
+            unsigned int else_block = IrFunction_new_block(b->fun);
+            unsigned int end_block = else_block;
+            bool has_else = b->ast->child_counts[node] == 3;
+            if (has_else) {
+                end_block = IrFunction_new_block(b->fun);
+            }
+
+            emit_condbr(b, irgen_cond(b, children[0]), then_block, else_block);
+
+            b->block = then_block;
+            irgen_node(b, children[1]);
+            if (!is_terminated(b)) {
+                emit_br(b, end_block);
+            }
+
+            if (has_else) {
+                b->block = else_block;
+                irgen_node(b, children[2]);
+                if (!is_terminated(b)) {
+                    emit_br(b, end_block);
+                }
+            }
+
+            b->block = end_block;
+            break;
+        }
+
+        case NODE_RETURN:
+            emit_ret(b, irgen_expr(b, node - 1));
+            break;
+
+        case NODE_WHILE:
+        {
+            FlatAST_children(b->ast, node, children);
+            unsigned int cond_block = IrFunction_new_block(b->fun);
+            unsigned int body_block = IrFunction_new_block(b->fun);
+            unsigned int end_block = IrFunction_new_block(b->fun);
+
+            emit_br(b, cond_block);
+
+            b->block = cond_block;
+            emit_condbr(b, irgen_cond(b, children[0]), body_block, end_block);
+
+            b->block = body_block;
+            irgen_node(b, children[1]);
+            if (!is_terminated(b)) {
+                emit_br(b, cond_block);
+            }
+
+            b->block = end_block;
+            break;
+        }
+
+        case NODE_FUNCTION_DEF:
+        case NODE_PROGRAM:
+            ASSERT(0);
+            break;
+
+        default:
+            irgen_expr(b, node);
+            break;
+    }
+}
+
+static struct IrFunction irgen_function(const struct FlatAST* ast, uint32_t node, const struct SymbolTable* symbols)
+{
+    const struct Declaration* decl = SymbolTable_get(symbols, (uint32_t)ast->data[node]);
+    struct IrFunction fun;
+    IrFunction_init(&fun, decl->ident, decl->data.fun.frame_size / 8);
+
+    struct IrBuilder b;
+    b.fun = &fun;
+    b.block = IrFunction_new_block(&fun);
+    b.symbols = symbols;
+    b.ast = ast;
+    dynarray_init(&b.values, sizeof(struct IrOperand));
+    dynarray_init(&b.children, sizeof(uint32_t));
+
+    irgen_children(&b, node);
+
+    // falling off the end of main returns 0, for the other functions the value is undefined anyway
+    if (!is_terminated(&b)) {
+        emit_ret(&b, IrOperand_const(0));
+    }
+
+    dynarray_destroy(&b.values);
+    dynarray_destroy(&b.children);
+    ir_mem2reg(&fun);
+
+    return fun;
+}
+
+struct IrProgram irgen(const struct FlatAST* ast, const struct SymbolTable* symbols)
+{
+    struct IrProgram ir;
+    dynarray_init(&ir.functions, sizeof(struct IrFunction));
+
+    // the program is the last node, and its functions are the top-level subtrees before it
+    uint32_t program = ast->count - 1;
+    ASSERT(ast->kinds[program] == NODE_PROGRAM)
+    uint32_t* functions = malloc(ast->child_counts[program] * sizeof(uint32_t));
+    FlatAST_children(ast, program, functions);
+    for (uint32_t i = 0; i < ast->child_counts[program]; i++) {
+        ASSERT(ast->kinds[functions[i]] == NODE_FUNCTION_DEF)
+        struct IrFunction fun = irgen_function(ast, functions[i], symbols);
+        dynarray_push(&ir.functions, &fun);
+    }
+    free(functions);
+
+    return ir;
+}
@@ -0,0 +1,210 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include "jit.h"
+#include "util.h"
+
+// rbp is saved by the prologue of every function
+static const enum Register callee_saved[] = {
+        REG_RBX,
+        REG_R12,
+        REG_R13,
+        REG_R14,
+        REG_R15,
+};
+
+#define CALLEE_SAVED_COUNT (sizeof(callee_saved) / sizeof(callee_saved[0]))
+
+/// The generated functions don't preserve the registers the System V ABI asks them to,
+/// so main is called through a thunk that saves them. The five pushes also realign the stack
+/// to 16 bytes before the call, like a regular caller would.
+static unsigned int emit_entry_thunk(struct AsmBuffer* buf)
+{
+    asm_begin_function(buf, "jit.entry");
+
+    for (size_t i = 0; i < CALLEE_SAVED_COUNT; i++) {
+        asm_emit1(buf, ASM_PUSH, Operand_reg(callee_saved[i]));
+    }
+    asm_emit1(buf, ASM_CALL, Operand_label(asm_named_label(buf, "main")));
+    for (size_t i = CALLEE_SAVED_COUNT; i > 0; i--) {
+        asm_emit1(buf, ASM_POP, Operand_reg(callee_saved[i-1]));
+    }
+    asm_emit0(buf, ASM_RET);
+    asm_end_function(buf);
+
+    return asm_named_label(buf, "jit.entry");
+}
+
+static void function_range(const struct MachineCode* code, const struct AsmFunction* fun, size_t* begin, size_t* size)
+{
+    *begin = *(size_t*)dynarray_get(&code->label_offsets, fun->label);
+    *size = *(size_t*)dynarray_get(&code->label_offsets, fun->end_label) - *begin;
+}
+
+/// One "START SIZE name" line per function, the format perf reads for code it can't find in a mapped file
+static void write_perf_map(const struct AsmBuffer* buf, const struct MachineCode* code, const unsigned char* mem)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%ld.map", (long)getpid());
+    FILE* fp = fopen(path, "a");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    for (size_t i = 0; i < dynarray_length(&buf->functions); i++) {
+        const struct AsmFunction* fun = dynarray_get(&buf->functions, i);
+        const struct Label* label = dynarray_get(&buf->labels, fun->label);
+        size_t begin, size;
+        function_range(code, fun, &begin, &size);
+        fprintf(fp, "%lx %lx %s\n", (unsigned long)(uintptr_t)(mem + begin), (unsigned long)size, label->name);
+    }
+
+    fclose(fp);
+}
+
+// see tools/perf/Documentation/jitdump-specification.txt in the Linux sources
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JIT_CODE_LOAD 0
+
+struct JitdumpHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+};
+
+struct JitdumpCodeLoad {
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+    // followed by the NUL-terminated name and the code bytes
+};
+
+// perf inject matches these against the sample timestamps, which are only CLOCK_MONOTONIC when
+// perf record is run with -k mono
+static uint64_t jitdump_timestamp()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/// Write a code load record per function. perf only notices the file if it is mapped executable,
+/// so the mapping is kept until the process exits
+static void write_jitdump(const struct AsmBuffer* buf, const struct MachineCode* code, const unsigned char* mem)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "jit-%ld.dump", (long)getpid());
+    int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    FILE* fp = fdopen(fd, "w+");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        close(fd);
+        return;
+    }
+
+    if (mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0) == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s: %s\n", path, strerror(errno));
+        // closes fd as well
+        fclose(fp);
+        return;
+    }
+
+    struct JitdumpHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = JITDUMP_MAGIC;
+    header.version = JITDUMP_VERSION;
+    header.total_size = sizeof(header);
+    header.elf_mach = EM_X86_64;
+    header.pid = getpid();
+    header.timestamp = jitdump_timestamp();
+    fwrite(&header, sizeof(header), 1, fp);
+
+    for (size_t i = 0; i < dynarray_length(&buf->functions); i++) {
+        const struct AsmFunction* fun = dynarray_get(&buf->functions, i);
+        const struct Label* label = dynarray_get(&buf->labels, fun->label);
+        size_t begin, size;
+        function_range(code, fun, &begin, &size);
+
+        struct JitdumpCodeLoad record;
+        memset(&record, 0, sizeof(record));
+        record.id = JIT_CODE_LOAD;
+        record.total_size = sizeof(record) + strlen(label->name) + 1 + size;
+        record.timestamp = jitdump_timestamp();
+        record.pid = getpid();
+        record.tid = getpid();
+        record.vma = (uintptr_t)(mem + begin);
+        record.code_addr = record.vma;
+        record.code_size = size;
+        record.code_index = i;
+
+        fwrite(&record, sizeof(record), 1, fp);
+        fwrite(label->name, 1, strlen(label->name) + 1, fp);
+        fwrite(mem + begin, 1, size, fp);
+    }
+
+    fclose(fp);
+}
+
+int64_t jit_run(struct AsmBuffer* buf, unsigned int flags)
+{
+    unsigned int entry = emit_entry_thunk(buf);
+
+    struct MachineCode code;
+    asm_encode(buf, &code);
+    size_t size = dynarray_length(&code.bytes);
+
+    // never writable and executable at the same time
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "Failed to map JIT memory: %s\n", strerror(errno));
+        exit(1);
+    }
+    memcpy(mem, code.bytes.data, size);
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+        fprintf(stderr, "Failed to make JIT memory executable: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    if (flags & JIT_PERF_MAP) {
+        write_perf_map(buf, &code, mem);
+    }
+    if (flags & JIT_JITDUMP) {
+        write_jitdump(buf, &code, mem);
+    }
+
+    // ISO C has no conversion from object to function pointers, copy the representation instead
+    void* addr = (unsigned char*)mem + *(size_t*)dynarray_get(&code.label_offsets, entry);
+    int64_t (*fn)(void);
+    memcpy(&fn, &addr, sizeof(fn));
+
+    int64_t ret = fn();
+
+    munmap(mem, size);
+    MachineCode_destroy(&code);
+
+    return ret;
+}
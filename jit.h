@@ -0,0 +1,14 @@
+#ifndef TOYCC_JIT_H
+#define TOYCC_JIT_H
+#include <stdint.h>
+#include "asm.h"
+
+enum JitFlags {
+    JIT_PERF_MAP = 1 << 0, // write /tmp/perf-<pid>.map so perf can name the generated functions
+    JIT_JITDUMP = 1 << 1,  // write jit-<pid>.dump with the code bytes for perf inject --jit, record with perf record -k mono
+};
+
+/// Encode the program into executable memory and call main in-process, returning its result
+int64_t jit_run(struct AsmBuffer* buf, unsigned int flags);
+
+#endif //TOYCC_JIT_H
@@ -1,144 +1,945 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include <ctype.h>
+#include <stdarg.h>
+#include <pthread.h>
 #include "toycc.h"
+#include "util.h"
 
-struct CharIterator {
-    const char *data;
-    size_t index;
-    size_t size;
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+enum CharClass {
+    CC_NUL, // the sentinel at the end of the input
+    CC_OTHER,
+    CC_SPACE,
+    CC_DIGIT,
+    CC_ALPHA,
+    CC_ADD,
+    CC_SUB,
+    CC_MUL,
+    CC_DIV,
+    CC_EQUAL,
+    CC_LESS,
+    CC_LEFT_PAREN,
+    CC_RIGHT_PAREN,
+    CC_LEFT_CURLY_BRACKET,
+    CC_RIGHT_CURLY_BRACKET,
+    CC_SEMICOLON,
+    CC_COMMA,
+    CC_COUNT,
+};
+
+/// States of a token that isn't finished yet. Whitespace, comments and identifiers are long runs
+/// that are skipped by the scanners below before the DFA runs
+enum LexState {
+    ST_START,
+    ST_INT,
+    ST_ADD, // '+', which can still become '+=' or '++'
+    ST_ASSIGN, // '=', which can still become '=='
+    ST_COUNT,
 };
 
-static void CharIterator_init(struct CharIterator *iter, const char* data, size_t size) {
-    iter->data = data;
-    iter->index = 0;
-    iter->size = size;
+// A transition either goes to another LexState or accepts a token, with its kind in the low bits.
+// ACCEPT_BEFORE accepts without the current character, which then starts the next token
+#define ACCEPT 0x80
+#define PUSH_BACK 0x40
+#define KIND_MASK 0x3f
+#define ACCEPT_HERE(kind) (ACCEPT | (kind))
+#define ACCEPT_BEFORE(kind) (ACCEPT | PUSH_BACK | (kind))
+
+// pseudo token kinds, after every enum TokenType value
+#define LEX_EOF 0x3e
+#define LEX_ERROR 0x3f
+
+static uint8_t char_class[256];
+static uint8_t transitions[ST_COUNT][CC_COUNT];
+static bool tables_ready = false;
+
+static void init_tables()
+{
+    for (int c = 0; c < 256; c++) {
+        char_class[c] = CC_OTHER;
+    }
+    char_class[0] = CC_NUL;
+    char_class[' '] = CC_SPACE;
+    char_class['\t'] = CC_SPACE;
+    char_class['\n'] = CC_SPACE;
+    char_class['\v'] = CC_SPACE;
+    char_class['\f'] = CC_SPACE;
+    char_class['\r'] = CC_SPACE;
+    for (int c = '0'; c <= '9'; c++) {
+        char_class[c] = CC_DIGIT;
+    }
+    for (int c = 'a'; c <= 'z'; c++) {
+        char_class[c] = CC_ALPHA;
+        char_class[c - 'a' + 'A'] = CC_ALPHA;
+    }
+    char_class['+'] = CC_ADD;
+    char_class['-'] = CC_SUB;
+    char_class['*'] = CC_MUL;
+    char_class['/'] = CC_DIV;
+    char_class['='] = CC_EQUAL;
+    char_class['<'] = CC_LESS;
+    char_class['('] = CC_LEFT_PAREN;
+    char_class[')'] = CC_RIGHT_PAREN;
+    char_class['{'] = CC_LEFT_CURLY_BRACKET;
+    char_class['}'] = CC_RIGHT_CURLY_BRACKET;
+    char_class[';'] = CC_SEMICOLON;
+    char_class[','] = CC_COMMA;
+
+    // any character that doesn't continue a token ends it
+    for (int cc = 0; cc < CC_COUNT; cc++) {
+        transitions[ST_START][cc] = ACCEPT_HERE(LEX_ERROR);
+        transitions[ST_INT][cc] = ACCEPT_BEFORE(TOK_INT);
+        transitions[ST_ADD][cc] = ACCEPT_BEFORE(TOK_ADD);
+        transitions[ST_ASSIGN][cc] = ACCEPT_BEFORE(TOK_ASSIGN);
+    }
+
+    transitions[ST_START][CC_NUL] = ACCEPT_HERE(LEX_EOF);
+    transitions[ST_START][CC_DIGIT] = ST_INT;
+    transitions[ST_START][CC_ADD] = ST_ADD;
+    transitions[ST_START][CC_SUB] = ACCEPT_HERE(TOK_SUB);
+    transitions[ST_START][CC_MUL] = ACCEPT_HERE(TOK_MUL);
+    transitions[ST_START][CC_DIV] = ACCEPT_HERE(TOK_DIV);
+    transitions[ST_START][CC_EQUAL] = ST_ASSIGN;
+    transitions[ST_START][CC_LESS] = ACCEPT_HERE(TOK_LESS_THAN);
+    transitions[ST_START][CC_LEFT_PAREN] = ACCEPT_HERE(TOK_LEFT_PAREN);
+    transitions[ST_START][CC_RIGHT_PAREN] = ACCEPT_HERE(TOK_RIGHT_PAREN);
+    transitions[ST_START][CC_LEFT_CURLY_BRACKET] = ACCEPT_HERE(TOK_LEFT_CURLY_BRACKET);
+    transitions[ST_START][CC_RIGHT_CURLY_BRACKET] = ACCEPT_HERE(TOK_RIGHT_CURLY_BRACKET);
+    transitions[ST_START][CC_SEMICOLON] = ACCEPT_HERE(TOK_SEMICOLON);
+    transitions[ST_START][CC_COMMA] = ACCEPT_HERE(TOK_COMMA);
+
+    // a literal continues with letters for its prefix, hex digits and suffixes, parse_int checks them
+    transitions[ST_INT][CC_DIGIT] = ST_INT;
+    transitions[ST_INT][CC_ALPHA] = ST_INT;
+
+    transitions[ST_ADD][CC_EQUAL] = ACCEPT_HERE(TOK_ASSIGN_ADD);
+    transitions[ST_ADD][CC_ADD] = ACCEPT_HERE(TOK_INCREMENT);
+
+    transitions[ST_ASSIGN][CC_EQUAL] = ACCEPT_HERE(TOK_EQUALS);
+
+    tables_ready = true;
 }
 
-static char peek(const struct CharIterator* iter) {
-    return iter->data[iter->index];
+// The scanners return the first byte at or after p that doesn't belong to the run. They stop at
+// the NUL terminator at the latest, and the vector versions rely on SOURCE_PADDING to load
+// past it
+struct Scanner {
+    const char* (*skip_space)(const char* p);
+    const char* (*skip_ident)(const char* p);
+    /// The first occurrence of a or b
+    const char* (*find_either)(const char* p, char a, char b);
+};
+
+static bool is_ident_char(char c)
+{
+    uint8_t cc = char_class[(unsigned char)c];
+    return cc == CC_ALPHA || cc == CC_DIGIT;
 }
 
-static char next(struct CharIterator* iter) {
-    char c = iter->data[iter->index];
-    iter->index++;
-    return c;
+static const char* skip_space_scalar(const char* p)
+{
+    while (char_class[(unsigned char)*p] == CC_SPACE) {
+        p++;
+    }
+    return p;
 }
 
-static bool has_next(const struct CharIterator* iter) {
-    return iter->index < iter->size;
+static const char* skip_ident_scalar(const char* p)
+{
+    while (is_ident_char(*p)) {
+        p++;
+    }
+    return p;
 }
 
-static bool consume(struct CharIterator* iter, char c) {
-    if (peek(iter) == c) {
-        next(iter);
-        return true;
+static const char* find_either_scalar(const char* p, char a, char b)
+{
+    while (*p != a && *p != b) {
+        p++;
+    }
+    return p;
+}
+
+#ifdef HAVE_X86_SIMD
+// SSE2 is part of x86-64, AVX2 is only used when the CPU reports it
+
+/// Bytes of x in [lo, lo+n], as unsigned values
+static __m128i in_range_sse2(__m128i x, char lo, char n)
+{
+    __m128i d = _mm_sub_epi8(x, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(n)), d);
+}
+
+static __m128i is_space_sse2(__m128i x)
+{
+    return _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')), in_range_sse2(x, '\t', '\r' - '\t'));
+}
+
+static __m128i is_ident_sse2(__m128i x)
+{
+    __m128i lower = _mm_or_si128(x, _mm_set1_epi8(0x20));
+    return _mm_or_si128(in_range_sse2(x, '0', 9), in_range_sse2(lower, 'a', 25));
+}
+
+static const char* skip_space_sse2(const char* p)
+{
+    while (true) {
+        __m128i x = _mm_loadu_si128((const __m128i*)p);
+        unsigned int others = ~_mm_movemask_epi8(is_space_sse2(x)) & 0xffff;
+        if (others) {
+            return p + __builtin_ctz(others);
+        }
+        p += 16;
+    }
+}
+
+static const char* skip_ident_sse2(const char* p)
+{
+    while (true) {
+        __m128i x = _mm_loadu_si128((const __m128i*)p);
+        unsigned int others = ~_mm_movemask_epi8(is_ident_sse2(x)) & 0xffff;
+        if (others) {
+            return p + __builtin_ctz(others);
+        }
+        p += 16;
+    }
+}
+
+static const char* find_either_sse2(const char* p, char a, char b)
+{
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vb = _mm_set1_epi8(b);
+    while (true) {
+        __m128i x = _mm_loadu_si128((const __m128i*)p);
+        unsigned int found = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, va), _mm_cmpeq_epi8(x, vb)));
+        if (found) {
+            return p + __builtin_ctz(found);
+        }
+        p += 16;
+    }
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static __m256i in_range_avx2(__m256i x, char lo, char n)
+{
+    __m256i d = _mm256_sub_epi8(x, _mm256_set1_epi8(lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(n)), d);
+}
+
+AVX2 static __m256i is_space_avx2(__m256i x)
+{
+    return _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')), in_range_avx2(x, '\t', '\r' - '\t'));
+}
+
+AVX2 static __m256i is_ident_avx2(__m256i x)
+{
+    __m256i lower = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+    return _mm256_or_si256(in_range_avx2(x, '0', 9), in_range_avx2(lower, 'a', 25));
+}
+
+AVX2 static const char* skip_space_avx2(const char* p)
+{
+    while (true) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)p);
+        unsigned int others = ~(unsigned int)_mm256_movemask_epi8(is_space_avx2(x));
+        if (others) {
+            return p + __builtin_ctz(others);
+        }
+        p += 32;
+    }
+}
+
+AVX2 static const char* skip_ident_avx2(const char* p)
+{
+    while (true) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)p);
+        unsigned int others = ~(unsigned int)_mm256_movemask_epi8(is_ident_avx2(x));
+        if (others) {
+            return p + __builtin_ctz(others);
+        }
+        p += 32;
+    }
+}
+
+AVX2 static const char* find_either_avx2(const char* p, char a, char b)
+{
+    __m256i va = _mm256_set1_epi8(a);
+    __m256i vb = _mm256_set1_epi8(b);
+    while (true) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)p);
+        unsigned int found = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(x, va), _mm256_cmpeq_epi8(x, vb)));
+        if (found) {
+            return p + __builtin_ctz(found);
+        }
+        p += 32;
+    }
+}
+#endif
+
+static struct Scanner scanner;
+
+/// TOYCC_NO_SIMD=1 in the environment forces the scalar scanners, to compare them with the vector ones
+static void init_scanner()
+{
+    scanner.skip_space = skip_space_scalar;
+    scanner.skip_ident = skip_ident_scalar;
+    scanner.find_either = find_either_scalar;
+    if (getenv("TOYCC_NO_SIMD")) {
+        return;
+    }
+
+#ifdef HAVE_X86_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        scanner.skip_space = skip_space_avx2;
+        scanner.skip_ident = skip_ident_avx2;
+        scanner.find_either = find_either_avx2;
     } else {
-        return false;
+        scanner.skip_space = skip_space_sse2;
+        scanner.skip_ident = skip_ident_sse2;
+        scanner.find_either = find_either_sse2;
+    }
+#endif
+}
+
+/// p is after "//", return the newline or the end of the input
+static const char* skip_line_comment(const char* p, const char* end)
+{
+    p = scanner.find_either(p, '\n', '\0');
+    while (*p == '\0' && p != end) {
+        p = scanner.find_either(p + 1, '\n', '\0');
     }
+    return p;
 }
 
-static bool consume_pred(struct CharIterator* iter, int (*pred)(int), char* c) {
-    if (pred(peek(iter))) {
-        char n = next(iter);
-        if (c) {
-            *c = n;
+/// p is after "/*", return the character after "*/", or NULL if the comment isn't terminated
+static const char* skip_block_comment(const char* p, const char* end)
+{
+    while (true) {
+        p = scanner.find_either(p, '*', '\0');
+        if (p == end) {
+            return NULL;
         }
-        return true;
+        p++;
+        if (*p == '/') {
+            return p + 1;
+        }
+    }
+}
+
+/// Report the error, or keep it in the lexer with record_errors. Returns false so that callers can
+/// give up on the token with "return lexer_error(...)"
+__attribute__((format(printf, 3, 4)))
+static bool lexer_error(struct Lexer* lexer, uint32_t offset, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(lexer->error, sizeof(lexer->error), fmt, args);
+    va_end(args);
+
+    if (!lexer->record_errors) {
+        SourceFile_error(lexer->source, offset, "%s", lexer->error);
+    }
+    lexer->failed = true;
+    lexer->error_offset = offset;
+    return false;
+}
+
+/// Skip whitespace, "// ..." and "/* ... */". NUL characters before the end are part of comments
+static const char* skip_blanks(struct Lexer* lexer, const char* p)
+{
+    while (true) {
+        p = scanner.skip_space(p);
+        if (p[0] != '/') {
+            return p;
+        }
+
+        if (p[1] == '/') {
+            p = skip_line_comment(p + 2, lexer->end);
+        } else if (p[1] == '*') {
+            const char* comment = p;
+            p = skip_block_comment(p + 2, lexer->end);
+            if (!p) {
+                lexer_error(lexer, comment - lexer->input, "Unterminated comment");
+                return lexer->end;
+            }
+        } else {
+            return p;
+        }
+    }
+}
+
+struct Keyword {
+    const char* spelling;
+    size_t len;
+    enum TokenType kind;
+};
+
+// 2*s[0] + 2*s[1] + len, modulo 8. The factors were picked by hand so that the six keywords land
+// in distinct slots of an 8-entry table, which makes a lookup one probe and one memcmp
+#define KEYWORD_HASH(c0, c1, len) ((2*(unsigned int)(c0) + 2*(unsigned int)(c1) + (unsigned int)(len)) & 7)
+
+// Fails to compile if the keyword is not in the given slot. A new keyword needs a free slot here,
+// otherwise the hash has to be picked again
+#define CHECK_KEYWORD_SLOT(name, c0, c1, len, slot) \
+    typedef char keyword_slot_##name[(KEYWORD_HASH(c0, c1, len) == (slot)) ? 1 : -1]
+
+CHECK_KEYWORD_SLOT(if, 'i', 'f', 2, 0);
+CHECK_KEYWORD_SLOT(int, 'i', 'n', 3, 1);
+CHECK_KEYWORD_SLOT(while, 'w', 'h', 5, 3);
+CHECK_KEYWORD_SLOT(return, 'r', 'e', 6, 4);
+CHECK_KEYWORD_SLOT(for, 'f', 'o', 3, 5);
+CHECK_KEYWORD_SLOT(else, 'e', 'l', 4, 6);
+
+// Indexed by keyword_hash
+static const struct Keyword keyword_table[8] = {
+    { "if", 2, TOK_KW_IF },
+    { "int", 3, TOK_KW_INT },
+    { NULL, 0, TOK_IDENT },
+    { "while", 5, TOK_KW_WHILE },
+    { "return", 6, TOK_KW_RETURN },
+    { "for", 3, TOK_KW_FOR },
+    { "else", 4, TOK_KW_ELSE },
+    { NULL, 0, TOK_IDENT },
+};
+
+static unsigned int keyword_hash(const char* s, size_t len)
+{
+    return KEYWORD_HASH((unsigned char)s[0], (unsigned char)s[1], len);
+}
+
+/// The keyword token kind of the identifier, or TOK_IDENT
+static enum TokenType classify_keyword(const char* s, size_t len)
+{
+    // every keyword has between 2 and 6 characters, and the hash reads two of them
+    if (len < 2 || len > 6) {
+        return TOK_IDENT;
+    }
+
+    const struct Keyword* kw = &keyword_table[keyword_hash(s, len)];
+    if (kw->len == len && memcmp(kw->spelling, s, len) == 0) {
+        return kw->kind;
+    }
+    return TOK_IDENT;
+}
+
+#define ONES 0x0101010101010101ULL
+
+/// Whether the 8 bytes, in memory order, are all ASCII digits
+static bool all_digits(uint64_t chunk)
+{
+    // a byte is a digit if its high nibble is 3 and adding 6 doesn't carry into the high nibble
+    uint64_t high = chunk & (0xf0 * ONES);
+    uint64_t carried = (chunk + 0x06 * ONES) & (0xf0 * ONES);
+    return (high | (carried >> 4)) == 0x33 * ONES;
+}
+
+/// The value of 8 ASCII digits, the first one in the lowest byte. Pairs of digits, then groups of
+/// four, then both halves are combined with three multiplications instead of eight
+static uint32_t parse_8_digits(uint64_t chunk)
+{
+    chunk -= 0x30 * ONES;
+    chunk = chunk * 10 + (chunk >> 8);
+    uint64_t mask = 0x000000ff000000ffULL;
+    uint64_t mul1 = 100 + (1000000ULL << 32);
+    uint64_t mul2 = 1 + (10000ULL << 32);
+    return (uint32_t)((((chunk & mask) * mul1) + (((chunk >> 16) & mask) * mul2)) >> 32);
+}
+
+static uint64_t load_u64_le(const char* s)
+{
+    // assembled byte by byte so that the digit order doesn't depend on the host, compilers turn
+    // this into a single load on little-endian targets
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        v |= (uint64_t)(unsigned char)s[i] << (8 * i);
+    }
+    return v;
+}
+
+static int digit_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return 16;
+}
+
+/// Parse the decimal digits at the start of s[0, len), return how many were read
+static size_t parse_decimal(const char* s, size_t len, uint64_t* value, bool* overflow)
+{
+    uint64_t v = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t chunk = load_u64_le(&s[i]);
+        if (!all_digits(chunk)) {
+            break;
+        }
+        uint64_t digits = parse_8_digits(chunk);
+        if (v > (UINT64_MAX - digits) / 100000000) {
+            *overflow = true;
+        }
+        v = v * 100000000 + digits;
+    }
+    for (; i < len && s[i] >= '0' && s[i] <= '9'; i++) {
+        uint64_t digit = s[i] - '0';
+        if (v > (UINT64_MAX - digit) / 10) {
+            *overflow = true;
+        }
+        v = v * 10 + digit;
+    }
+    *value = v;
+    return i;
+}
+
+/// Parse the digits of a power of two radix, return how many were read
+static size_t parse_pow2(const char* s, size_t len, unsigned int bits, uint64_t* value, bool* overflow)
+{
+    uint64_t v = 0;
+    size_t i = 0;
+    for (; i < len; i++) {
+        int digit = digit_value(s[i]);
+        if (digit >= (1 << bits)) {
+            break;
+        }
+        if (v >> (64 - bits)) {
+            *overflow = true;
+        }
+        v = (v << bits) | digit;
+    }
+    *value = v;
+    return i;
+}
+
+static bool invalid_literal(struct Lexer* lexer, const char* s, size_t len, const char* reason)
+{
+    return lexer_error(lexer, s - lexer->input, "%s: %.*s", reason, (int)len, s);
+}
+
+/// s[0, len) is a digit followed by letters and digits. Values between INT64_MAX and UINT64_MAX
+/// wrap to negative, like they would in a 64-bit register
+static bool parse_int(struct Lexer* lexer, struct Token* tok, const char* s, size_t len)
+{
+    uint64_t value;
+    bool overflow = false;
+    size_t i;
+    if (len > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        i = 2 + parse_pow2(&s[2], len - 2, 4, &value, &overflow);
+        if (i == 2) {
+            return invalid_literal(lexer, s, len, "Invalid integer literal");
+        }
+    } else if (len > 2 && s[0] == '0' && (s[1] == 'b' || s[1] == 'B')) {
+        i = 2 + parse_pow2(&s[2], len - 2, 1, &value, &overflow);
+        if (i == 2) {
+            return invalid_literal(lexer, s, len, "Invalid integer literal");
+        }
+    } else if (s[0] == '0') {
+        i = 1 + parse_pow2(&s[1], len - 1, 3, &value, &overflow);
     } else {
-        return false;
+        i = parse_decimal(s, len, &value, &overflow);
+    }
+
+    if (overflow) {
+        return invalid_literal(lexer, s, len, "Integer literal is too large");
+    }
+
+    // the suffix is u, l or ll in either order, and in either case. Every integer is 64 bits for now,
+    // so it is only checked
+    bool is_unsigned = false;
+    bool is_long = false;
+    while (i < len) {
+        if ((s[i] == 'u' || s[i] == 'U') && !is_unsigned) {
+            is_unsigned = true;
+            i++;
+        } else if ((s[i] == 'l' || s[i] == 'L') && !is_long) {
+            is_long = true;
+            i++;
+            if (i < len && s[i] == s[i - 1]) {
+                i++;
+            }
+        } else {
+            return invalid_literal(lexer, s, len, "Invalid integer literal");
+        }
     }
+
+    tok->data.i64 = (int64_t)value;
+    return true;
 }
 
-static struct Token match_num(struct CharIterator* iter) {
-    int64_t num = 0;
-    while (isdigit(peek(iter))) {
-        int v = next(iter) - '0';
-        num = 10 * num + v;
+void Lexer_init(struct Lexer* lexer, struct SourceFile* source)
+{
+    if (!tables_ready) {
+        init_tables();
+        init_scanner();
     }
 
-    struct Token tok;
-    tok.kind = TOK_INT;
-    tok.data.i64 = num;
-    return tok;
+    // token offsets are 32 bits
+    if (source->size > UINT32_MAX) {
+        fprintf(stderr, "%s: The input is larger than 4 GiB\n", source->path);
+        exit(1);
+    }
+
+    lexer->source = source;
+    lexer->input = source->data;
+    lexer->end = source->data + source->size;
+    lexer->stop = lexer->end;
+    lexer->p = lexer->input;
+    lexer->defer_interning = false;
+    lexer->record_errors = false;
+    lexer->failed = false;
 }
 
-static struct Token match_ident(struct CharIterator* iter)
+/// The first NUL stops every loop, and is only compared with the end of the input after that. Long
+/// runs go through the scanners, numbers and punctuators through the DFA with one table lookup per
+/// character
+bool Lexer_next(struct Lexer* lexer, struct Token* tok)
 {
-    struct dynarray string;
-    dynarray_init(&string, 1);
+    const char* p = skip_blanks(lexer, lexer->p);
+    if (p >= lexer->stop || lexer->failed) {
+        // stay there, so that calling again keeps returning false
+        lexer->p = p;
+        return false;
+    }
 
-    char c;
-    while (consume_pred(iter, isalnum, &c)) {
-        dynarray_push(&string, &c);
+    const char* start = p;
+    tok->offset = start - lexer->input;
+
+    if (char_class[(unsigned char)*p] == CC_ALPHA) {
+        p = scanner.skip_ident(p + 1);
+        tok->kind = classify_keyword(start, p - start);
+        if (tok->kind == TOK_IDENT && lexer->defer_interning) {
+            tok->data.span_len = p - start;
+        } else if (tok->kind == TOK_IDENT) {
+            tok->data.ident = intern(start, p - start);
+        }
+        lexer->p = p;
+        return true;
     }
 
-    char null = 0;
-    dynarray_push(&string, &null);
+    uint8_t state = ST_START;
+    do {
+        state = transitions[state][char_class[(unsigned char)*p]];
+        p++;
+    } while (!(state & ACCEPT));
 
-    struct Token tok;
-    tok.kind = TOK_IDENT;
-    tok.data.ident = (char*)string.data;
-
-    return tok;
-}
-
-void tokenize(struct dynarray* tokens, const char* input)
-{
-    struct CharIterator iter;
-    CharIterator_init(&iter, input, strlen(input));
-
-    while (has_next(&iter)) {
-        struct Token tok;
-        char c = peek(&iter);
-        if (isspace(c)) {
-            next(&iter);
-            continue;
-        } else if (isdigit(c)) {
-            tok = match_num(&iter);
-        } else if (isalpha(c)) {
-            tok = match_ident(&iter);
-        } else if (consume(&iter, '+')) {
-            if (consume(&iter, '=')) {
-                tok.kind = TOK_ASSIGN_ADD;
-            } else if (consume(&iter, '+')) {
-                tok.kind = TOK_INCREMENT;
-            } else {
-                tok.kind = TOK_ADD;
+    if (state & PUSH_BACK) {
+        p--;
+    }
+
+    // the end of the input was handled above, this NUL is part of it
+    tok->kind = state & KIND_MASK;
+    bool ok = true;
+    if (tok->kind == LEX_EOF) {
+        ok = lexer_error(lexer, tok->offset, "Unexpected NUL character");
+    } else if (tok->kind == LEX_ERROR) {
+        ok = lexer_error(lexer, tok->offset, "Unexpected token: %c", *start);
+    } else if (tok->kind == TOK_INT) {
+        ok = parse_int(lexer, tok, start, p - start);
+    }
+    // after an error, stay at the end so that calling again keeps returning false
+    lexer->p = ok ? p : lexer->end;
+    return ok;
+}
+
+void TokenStream_init(struct TokenStream* tokens, size_t capacity)
+{
+    dynarray_init_with_capacity(&tokens->kinds, sizeof(uint8_t), capacity);
+    dynarray_init_with_capacity(&tokens->payloads, sizeof(uint32_t), capacity);
+    dynarray_init_with_capacity(&tokens->offsets, sizeof(uint32_t), capacity);
+    dynarray_init(&tokens->literals, sizeof(int64_t));
+    tokens->error[0] = 0;
+}
+
+void TokenStream_destroy(struct TokenStream* tokens)
+{
+    dynarray_destroy(&tokens->kinds);
+    dynarray_destroy(&tokens->payloads);
+    dynarray_destroy(&tokens->offsets);
+    dynarray_destroy(&tokens->literals);
+}
+
+size_t TokenStream_length(const struct TokenStream* tokens)
+{
+    return dynarray_length(&tokens->kinds);
+}
+
+void TokenStream_push(struct TokenStream* tokens, const struct Token* tok)
+{
+    uint32_t payload = 0;
+    if (tok->kind == TOK_IDENT) {
+        // the same bits as span_len
+        payload = tok->data.ident;
+    } else if (tok->kind == TOK_INT) {
+        payload = dynarray_length(&tokens->literals);
+        dynarray_push(&tokens->literals, (void*)&tok->data.i64);
+    }
+
+    uint8_t kind = tok->kind;
+    uint32_t offset = tok->offset;
+    dynarray_push(&tokens->kinds, &kind);
+    dynarray_push(&tokens->payloads, &payload);
+    dynarray_push(&tokens->offsets, &offset);
+}
+
+void TokenStream_get(const struct TokenStream* tokens, size_t index, struct Token* tok)
+{
+    tok->kind = ((const uint8_t*)tokens->kinds.data)[index];
+    tok->offset = ((const uint32_t*)tokens->offsets.data)[index];
+    uint32_t payload = ((const uint32_t*)tokens->payloads.data)[index];
+    if (tok->kind == TOK_IDENT) {
+        tok->data.ident = payload;
+    } else if (tok->kind == TOK_INT) {
+        tok->data.i64 = ((const int64_t*)tokens->literals.data)[payload];
+    }
+}
+
+// chunks smaller than this aren't worth a thread
+#define MIN_CHUNK_SIZE (256 * 1024)
+
+/// Split [input, end) into count chunks of about the same size. A chunk starts at whitespace or at
+/// the start of a comment, outside of any comment, so that no token crosses a boundary. This is a
+/// sequential pass, but it only stops at slashes to follow comments
+static void find_chunks(const char* input, const char* end, size_t count, const char** starts)
+{
+    const char* p = input;
+    const char* slash = NULL; // the next '/' or NUL at or after p, once it is known
+    starts[0] = input;
+    for (size_t k = 1; k < count; k++) {
+        const char* target = input + (end - input) * k / count;
+
+        // follow the comments up to target, p is always outside of them
+        while (p < target) {
+            if (!slash || slash < p) {
+                slash = scanner.find_either(p, '/', '\0');
             }
-        } else if (consume(&iter, '-')) {
-            tok.kind = TOK_SUB;
-        } else if (consume(&iter, '*')) {
-            tok.kind = TOK_MUL;
-        } else if (consume(&iter, '/')) {
-            tok.kind = TOK_DIV;
-        } else if (consume(&iter, '(')) {
-            tok.kind = TOK_LEFT_PAREN;
-        } else if (consume(&iter, ')')) {
-            tok.kind = TOK_RIGHT_PAREN;
-        } else if (consume(&iter, ';')) {
-            tok.kind = TOK_SEMICOLON;
-        } else if (consume(&iter, '=')) {
-            if (consume(&iter, '=')) {
-                tok.kind = TOK_EQUALS;
+            if (slash >= target) {
+                p = target;
+            } else if (slash[1] == '/') {
+                p = skip_line_comment(slash + 2, end);
+            } else if (slash[1] == '*') {
+                // the lexer of the chunk reports an unterminated comment
+                p = skip_block_comment(slash + 2, end);
+                if (!p) {
+                    p = end;
+                }
             } else {
-                tok.kind = TOK_ASSIGN;
+                p = slash + 1;
             }
-        } else if (consume(&iter, '{')) {
-            tok.kind = TOK_LEFT_CURLY_BRACKET;
-        } else if (consume(&iter, '}')) {
-            tok.kind = TOK_RIGHT_CURLY_BRACKET;
-        } else if (consume(&iter, '<')) {
-            tok.kind = TOK_LESS_THAN;
-        } else if (consume(&iter, ',')) {
-            tok.kind = TOK_COMMA;
-        } else {
-            fprintf(stderr, "Unexpected token: %c\n", c);
-            exit(1);
         }
-        dynarray_push(tokens, &tok);
+
+        // a comment can't start inside a token, so either one ends the token p may be in
+        while (p < end && char_class[(unsigned char)*p] != CC_SPACE && !(p[0] == '/' && (p[1] == '/' || p[1] == '*'))) {
+            p++;
+        }
+        starts[k] = p;
     }
 }
+
+struct LexChunk {
+    struct SourceFile* source;
+    const char* begin; // the tokens of the chunk are the ones starting in [begin, stop)
+    const char* stop;
+    struct TokenStream tokens; // with deferred interning
+    bool failed; // the chunk stopped at its first error, which the joining thread reports
+    uint32_t error_offset;
+    char error[128];
+};
+
+struct LexPool {
+    struct LexChunk* chunks;
+    size_t count;
+    size_t next; // the next chunk nobody took
+    pthread_mutex_t lock;
+};
+
+// how much of a chunk estimate_tokens lexes
+#define TOKEN_SAMPLE_SIZE 4096
+
+/// Extrapolate the number of tokens in the size bytes at lexer->p from the density of the first few
+/// KiB, with some slack so that the arrays rarely grow. lexer is a copy, the tokens are lexed again
+static size_t estimate_tokens(struct Lexer lexer, size_t size)
+{
+    const char* begin = lexer.p;
+    size_t count = 0;
+    struct Token tok;
+    while ((size_t)(lexer.p - begin) < TOKEN_SAMPLE_SIZE && Lexer_next(&lexer, &tok)) {
+        count++;
+    }
+
+    size_t sampled = lexer.p - begin;
+    if (sampled == 0 || sampled >= size) {
+        return count;
+    }
+    return count * (size / sampled) * 9 / 8 + 16;
+}
+
+static void lex_chunk(struct LexChunk* chunk)
+{
+    struct Lexer lexer;
+    Lexer_init(&lexer, chunk->source);
+    lexer.p = chunk->begin;
+    lexer.stop = chunk->stop;
+    // the interner isn't thread-safe, identifiers are interned when the chunks are stitched
+    lexer.defer_interning = true;
+    // SourceFile_error isn't thread-safe, and exiting from here would make the reported error
+    // depend on which thread gets there first
+    lexer.record_errors = true;
+
+    TokenStream_init(&chunk->tokens, estimate_tokens(lexer, chunk->stop - chunk->begin));
+    struct Token tok;
+    while (Lexer_next(&lexer, &tok)) {
+        TokenStream_push(&chunk->tokens, &tok);
+    }
+
+    chunk->failed = lexer.failed;
+    chunk->error_offset = lexer.error_offset;
+    memcpy(chunk->error, lexer.error, sizeof(chunk->error));
+}
+
+static void* lex_worker(void* arg)
+{
+    struct LexPool* pool = arg;
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        size_t i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->count) {
+            return NULL;
+        }
+        lex_chunk(&pool->chunks[i]);
+    }
+}
+
+void lex_parallel(struct SourceFile* source, unsigned int threads, struct TokenStream* tokens)
+{
+    // the tables are built before the threads start
+    struct Lexer lexer;
+    Lexer_init(&lexer, source);
+    const char* input = source->data;
+    size_t size = source->size;
+
+    // a few chunks per thread, so that a slow one doesn't hold up the others
+    size_t count = (size_t)threads * 4;
+    if (count > size / MIN_CHUNK_SIZE) {
+        count = size / MIN_CHUNK_SIZE;
+    }
+    if (count == 0) {
+        count = 1;
+    }
+
+    const char** starts = malloc(count * sizeof(const char*));
+    if (!starts) {
+        fprintf(stderr, "Failed to allocate %zu lexer chunks\n", count);
+        exit(1);
+    }
+    find_chunks(input, input + size, count, starts);
+
+    struct LexPool pool;
+    pool.chunks = malloc(count * sizeof(struct LexChunk));
+    if (!pool.chunks) {
+        fprintf(stderr, "Failed to allocate %zu lexer chunks\n", count);
+        exit(1);
+    }
+    pool.count = count;
+    pool.next = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    for (size_t k = 0; k < count; k++) {
+        struct LexChunk* chunk = &pool.chunks[k];
+        chunk->source = source;
+        chunk->begin = starts[k];
+        chunk->stop = (k + 1 < count) ? starts[k + 1] : input + size;
+    }
+
+    // the calling thread is one of the workers, and more threads than chunks would have nothing to do
+    if (threads > count) {
+        threads = count;
+    }
+    pthread_t* workers = malloc(threads * sizeof(pthread_t));
+    if (!workers) {
+        fprintf(stderr, "Failed to allocate %u lexer threads\n", threads);
+        exit(1);
+    }
+    unsigned int started = 0;
+    for (; started + 1 < threads; started++) {
+        int error = pthread_create(&workers[started], NULL, lex_worker, &pool);
+        if (error != 0) {
+            // the threads that did start, and this one, still take every chunk
+            fprintf(stderr, "Failed to start a lexer thread: %s\n", strerror(error));
+            break;
+        }
+    }
+    lex_worker(&pool);
+    for (unsigned int t = 0; t < started; t++) {
+        pthread_join(workers[t], NULL);
+    }
+
+    // the chunks are in source order and each one stopped at its first error, so the first failed
+    // chunk ends the stream. The error is only a token, so that it is reported when the parser gets
+    // there, like with the streaming lexer, and a parse error before it still comes first
+    size_t used = count;
+    for (size_t k = 0; k < count; k++) {
+        if (pool.chunks[k].failed) {
+            used = k + 1;
+            break;
+        }
+    }
+
+    size_t total = 1;
+    for (size_t k = 0; k < used; k++) {
+        total += TokenStream_length(&pool.chunks[k].tokens);
+    }
+
+    // offsets are already relative to the whole input, only identifiers and literal indices need
+    // fixing up
+    TokenStream_init(tokens, total);
+    for (size_t k = 0; k < used; k++) {
+        struct TokenStream* chunk = &pool.chunks[k].tokens;
+        size_t length = TokenStream_length(chunk);
+        const uint8_t* kinds = (const uint8_t*)chunk->kinds.data;
+        const uint32_t* offsets = (const uint32_t*)chunk->offsets.data;
+        uint32_t* payloads = (uint32_t*)chunk->payloads.data;
+        uint32_t literal_base = dynarray_length(&tokens->literals);
+        for (size_t i = 0; i < length; i++) {
+            if (kinds[i] == TOK_IDENT) {
+                payloads[i] = intern(input + offsets[i], payloads[i]);
+            } else if (kinds[i] == TOK_INT) {
+                payloads[i] += literal_base;
+            }
+        }
+
+        dynarray_append(&tokens->kinds, kinds, length);
+        dynarray_append(&tokens->payloads, payloads, length);
+        dynarray_append(&tokens->offsets, offsets, length);
+        dynarray_append(&tokens->literals, chunk->literals.data, dynarray_length(&chunk->literals));
+        TokenStream_destroy(chunk);
+    }
+    for (size_t k = used; k < count; k++) {
+        TokenStream_destroy(&pool.chunks[k].tokens);
+    }
+
+    struct LexChunk* last = &pool.chunks[used - 1];
+    if (last->failed) {
+        struct Token error;
+        error.kind = TOK_ERROR;
+        error.offset = last->error_offset;
+        TokenStream_push(tokens, &error);
+        memcpy(tokens->error, last->error, sizeof(tokens->error));
+    }
+
+    pthread_mutex_destroy(&pool.lock);
+    free(workers);
+    free(pool.chunks);
+    free(starts);
+}
@@ -1,14 +1,22 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <ctype.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
 #include "dynarray.h"
 #include "hashmap.h"
 #include "toycc.h"
 #include "util.h"
+#include "asm.h"
+#include "jit.h"
+#include "arena.h"
 
-void print_token(struct Token tok)
+/// Identifiers are expected to be lexed with defer_interning, and are printed straight from the source
+void print_token(const struct SourceFile* source, struct Token tok)
 {
     switch(tok.kind) {
         case TOK_ADD:
@@ -36,7 +44,7 @@ void print_token(struct Token tok)
             break;
 
         case TOK_IDENT:
-            printf("%s ", tok.data.ident);
+            printf("%.*s ", (int)tok.data.span_len, source->data + tok.offset);
             break;
 
         case TOK_INCREMENT:
@@ -47,6 +55,30 @@ void print_token(struct Token tok)
             printf("%ld ", tok.data.i64);
             break;
 
+        case TOK_KW_ELSE:
+            printf("else ");
+            break;
+
+        case TOK_KW_FOR:
+            printf("for ");
+            break;
+
+        case TOK_KW_IF:
+            printf("if ");
+            break;
+
+        case TOK_KW_INT:
+            printf("int ");
+            break;
+
+        case TOK_KW_RETURN:
+            printf("return ");
+            break;
+
+        case TOK_KW_WHILE:
+            printf("while ");
+            break;
+
         case TOK_LEFT_CURLY_BRACKET:
             printf("{ ");
             break;
@@ -81,7 +113,7 @@ void print_token(struct Token tok)
     }
 }
 
-int ast_to_dot_file_rec(FILE* fp, const struct ASTNode* node, int node_id, int parent_id)
+int ast_to_dot_file_rec(FILE* fp, const struct ASTNode* node, const struct SymbolTable* symbols, int node_id, int parent_id)
 {
     fprintf(fp, "n%d [label=\"", node_id);
 
@@ -103,7 +135,7 @@ int ast_to_dot_file_rec(FILE* fp, const struct ASTNode* node, int node_id, int p
             break;
 
         case NODE_DECL:
-            fprintf(fp, "int %s", node->data.decl.ident);
+            fprintf(fp, "int %s", SymbolTable_get(symbols, node->data.decl)->ident);
             break;
 
         case NODE_DIV:
@@ -123,11 +155,11 @@ int ast_to_dot_file_rec(FILE* fp, const struct ASTNode* node, int node_id, int p
             break;
 
         case NODE_FUNCTION_DEF:
-            fprintf(fp, "fun %s", node->data.decl.ident);
+            fprintf(fp, "fun %s", SymbolTable_get(symbols, node->data.decl)->ident);
             break;
 
         case NODE_IDENT:
-            fprintf(fp, "%s", node->data.decl.ident);
+            fprintf(fp, "%s", SymbolTable_get(symbols, node->data.decl)->ident);
             break;
 
         case NODE_IF:
@@ -175,18 +207,18 @@ int ast_to_dot_file_rec(FILE* fp, const struct ASTNode* node, int node_id, int p
     fflush(fp);
 
     int child_id = node_id+1;
-    for (unsigned int i = 0; i < dynarray_length(&node->children); i++) {
-        child_id = ast_to_dot_file_rec(fp, dynarray_get(&node->children, i), child_id, node_id);
+    for (uint32_t i = 0; i < node->child_count; i++) {
+        child_id = ast_to_dot_file_rec(fp, node->children[i], symbols, child_id, node_id);
     }
 
     return child_id;
 }
 
 // returns the next available id
-void ast_to_dot_file(FILE* fp, const struct ASTNode* node)
+void ast_to_dot_file(FILE* fp, const struct ASTNode* node, const struct SymbolTable* symbols)
 {
     fprintf(fp, "digraph {\n");
-    ast_to_dot_file_rec(fp, node, 0, -1);
+    ast_to_dot_file_rec(fp, node, symbols, 0, -1);
     fprintf(fp, "}\n");
 }
 
@@ -195,43 +227,191 @@ void print_int(void* ptr)
     printf("%d\n", *(int*)ptr);
 }
 
+enum OutputKind {
+    OUTPUT_ASM,
+    OUTPUT_EXECUTABLE,
+    OUTPUT_IR,
+    OUTPUT_OBJECT,
+};
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [-S | -c | --emit=ir] [--peephole-stats] [--fold-stats] [--dump-tokens] [--lex-threads=<n>] [-o <output>] <file>\n"
+                    "       %s --run [--perf-map] [--jitdump] <file>\n"
+                    "--jitdump needs the samples to be recorded with perf record -k mono\n", argv0, argv0);
+    exit(1);
+}
+
 int main(int argc, char** argv)
 {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <file>\n", argv[0]);
-        exit(1);
+    enum OutputKind output_kind = OUTPUT_EXECUTABLE;
+    const char* input_path = NULL;
+    const char* output_path = NULL;
+    bool run = false;
+    unsigned int jit_flags = 0;
+    bool peephole_stats = false;
+    bool fold_stats = false;
+    bool dump_tokens = false;
+    unsigned int lex_threads = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-S") == 0) {
+            output_kind = OUTPUT_ASM;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            output_kind = OUTPUT_OBJECT;
+        } else if (strcmp(argv[i], "--emit=ir") == 0) {
+            output_kind = OUTPUT_IR;
+        } else if (strcmp(argv[i], "--run") == 0) {
+            run = true;
+        } else if (strcmp(argv[i], "--perf-map") == 0) {
+            jit_flags |= JIT_PERF_MAP;
+        } else if (strcmp(argv[i], "--jitdump") == 0) {
+            jit_flags |= JIT_JITDUMP;
+        } else if (strcmp(argv[i], "--peephole-stats") == 0) {
+            peephole_stats = true;
+        } else if (strcmp(argv[i], "--fold-stats") == 0) {
+            fold_stats = true;
+        } else if (strcmp(argv[i], "--dump-tokens") == 0) {
+            dump_tokens = true;
+        } else if (strncmp(argv[i], "--lex-threads=", 14) == 0) {
+            // strtoul accepts a sign and would wrap -1 around
+            const char* value = argv[i] + 14;
+            char* value_end;
+            errno = 0;
+            unsigned long threads = strtoul(value, &value_end, 10);
+            if (!isdigit((unsigned char)value[0]) || *value_end != 0 || errno != 0 || threads == 0 || threads > UINT_MAX) {
+                usage(argv[0]);
+            }
+            lex_threads = threads;
+        } else if (strcmp(argv[i], "-o") == 0 && i+1 < argc) {
+            output_path = argv[++i];
+        } else if ((argv[i][0] == '-' && strcmp(argv[i], "-") != 0) || input_path) {
+            usage(argv[0]);
+        } else {
+            input_path = argv[i];
+        }
     }
 
-    char* input = read_file(argv[1]);
-
-    struct dynarray tokens;
-    dynarray_init(&tokens, sizeof(struct Token));
-    tokenize(&tokens, input);
+    if (!input_path) {
+        usage(argv[0]);
+    }
 
-    for (size_t i = 0; i < dynarray_length(&tokens); i++) {
-        struct Token* tok = dynarray_get(&tokens, i);
-        print_token(*tok);
+    if (!output_path) {
+        switch(output_kind) {
+            case OUTPUT_ASM:
+                output_path = "out.s";
+                break;
+            case OUTPUT_EXECUTABLE:
+                output_path = "out";
+                break;
+            case OUTPUT_IR:
+                output_path = "out.ir";
+                break;
+            case OUTPUT_OBJECT:
+                output_path = "out.o";
+                break;
+        }
     }
 
-    printf("\n");
-    fflush(stdout);
+    struct SourceFile source;
+    SourceFile_open(&source, input_path);
+
+    if (dump_tokens) {
+        // a pass of its own, the parser lexes again as it goes
+        struct Lexer lexer;
+        Lexer_init(&lexer, &source);
+        lexer.defer_interning = true;
+        struct Token tok;
+        while (Lexer_next(&lexer, &tok)) {
+            print_token(&source, tok);
+        }
+
+        printf("\n");
+        fflush(stdout);
+    }
 
-    struct ASTNode ast = parse(tokens);
+    // the whole tree is freed at once after flattening
+    struct Arena ast_arena;
+    Arena_init(&ast_arena);
+    struct SymbolTable symbols;
+    SymbolTable_init(&symbols);
+    struct ASTNode* ast = parse(&source, lex_threads, &ast_arena, &symbols);
 
     FILE* dot = fopen("ast.dot", "w");
-    ast_to_dot_file(dot, &ast);
+    ast_to_dot_file(dot, ast, &symbols);
     fclose(dot);
 
-    FILE* fp = fopen("out.s", "w");
+    unsigned int removed = fold_constants(ast);
+    if (fold_stats) {
+        fprintf(stderr, "Constant folding removed %u nodes\n", removed);
+    }
+
+    // irgen scans the flat encoding, the tree isn't needed past this point
+    struct FlatAST flat;
+    FlatAST_init(&flat, ast);
+    Arena_destroy(&ast_arena);
+
+    struct IrProgram ir = irgen(&flat, &symbols);
+    FlatAST_destroy(&flat);
+    SymbolTable_destroy(&symbols);
+
+    if (output_kind == OUTPUT_IR && !run) {
+        FILE* fp = fopen(output_path, "w");
+        if (!fp) {
+            fprintf(stderr, "Failed to open %s\n", output_path);
+            exit(1);
+        }
+        ir_print(&ir, fp);
+        fclose(fp);
+        IrProgram_destroy(&ir);
+        SourceFile_close(&source);
+        return 0;
+    }
+
+    struct AsmBuffer buf;
+    AsmBuffer_init(&buf);
+    codegen(&ir, &buf);
+    IrProgram_destroy(&ir);
+
+    if (peephole_stats) {
+        peephole_print_stats(stderr);
+    }
+
+    if (run) {
+        // like _start, hand the return value of main to exit
+        int64_t ret = jit_run(&buf, jit_flags);
+        AsmBuffer_destroy(&buf);
+        SourceFile_close(&source);
+        return (int)ret;
+    }
+
+    FILE* fp = fopen(output_path, (output_kind == OUTPUT_ASM) ? "w" : "wb");
     if (!fp) {
-        fprintf(stderr, "Failed to open out.asm");
+        fprintf(stderr, "Failed to open %s\n", output_path);
         exit(1);
     }
 
-    codegen(ast, fp);
+    if (output_kind == OUTPUT_ASM) {
+        asm_print(&buf, fp);
+    } else {
+        struct MachineCode code;
+        asm_encode(&buf, &code);
+        if (output_kind == OUTPUT_EXECUTABLE) {
+            elf_write_executable(fp, &buf, &code);
+        } else {
+            elf_write_object(fp, &buf, &code);
+        }
+        MachineCode_destroy(&code);
+    }
     fclose(fp);
 
-    dynarray_destroy(&tokens);
+    if (output_kind == OUTPUT_EXECUTABLE && chmod(output_path, 0755) != 0) {
+        fprintf(stderr, "Failed to make %s executable\n", output_path);
+        exit(1);
+    }
+
+    AsmBuffer_destroy(&buf);
+    SourceFile_close(&source);
 
     return 0;
 }
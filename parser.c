@@ -6,549 +6,689 @@
 #include "dynarray.h"
 #include "util.h"
 #include "type.h"
+#include "arena.h"
 
 struct Context {
-    struct Scope* scope;
+    struct ScopeStack* scopes;
     unsigned int* frame_size;
+    struct SymbolTable* symbols;
+    struct Arena* arena;
+    struct dynarray* pending; // struct ASTNode*, the statements of the blocks being parsed
 };
 
-void Scope_init(struct Scope* scope, const struct Scope* parent)
+void SymbolTable_init(struct SymbolTable* symbols)
 {
-    scope->parent = parent;
-    hashmap_init(&scope->decls, sizeof(struct Declaration));
+    dynarray_init(&symbols->decls, sizeof(struct Declaration));
 }
 
-bool Scope_find(const struct Scope* scope, const char* ident, struct Declaration* var)
+void SymbolTable_destroy(struct SymbolTable* symbols)
 {
-    if (hashmap_get(&scope->decls, ident, var)) {
-        return true;
-    } else if (scope->parent) {
-        return Scope_find(scope->parent, ident, var);
-    } else {
-        return false;
-    }
+    dynarray_destroy(&symbols->decls);
 }
 
-void Scope_append(struct Scope* scope, const struct Declaration* var)
+uint32_t SymbolTable_add(struct SymbolTable* symbols, const struct Declaration* decl)
 {
-    // TODO: do a single query
-    struct Declaration scratch;
-    if (hashmap_get(&scope->decls, var->ident, &scratch)) {
-        fprintf(stderr, "Identifier already declared in this scope: %s\n", var->ident);
-        exit(1);
-    }
-    hashmap_set(&scope->decls, var->ident, var);
+    uint32_t index = dynarray_length(&symbols->decls);
+    dynarray_push(&symbols->decls, (void*)decl);
+    return index;
 }
 
-void ASTNode_init(struct ASTNode* node, enum NodeKind kind)
+struct Declaration* SymbolTable_get(const struct SymbolTable* symbols, uint32_t index)
 {
-    node->kind = kind;
-    dynarray_init(&node->children, sizeof(struct ASTNode));
+    return dynarray_get(&symbols->decls, index);
 }
 
-void ASTNode_init_binary(struct ASTNode* node, enum NodeKind kind, struct ASTNode left, struct ASTNode right)
+struct Shadowed {
+    unsigned int sym;
+    struct Binding previous;
+};
+
+static void ScopeStack_init(struct ScopeStack* scopes)
 {
-    dynarray_init_with_capacity(&node->children, sizeof(struct ASTNode), 2);
-    dynarray_push(&node->children, &left);
-    dynarray_push(&node->children, &right);
-    node->kind = kind;
+    scopes->bindings = NULL;
+    scopes->capacity = 0;
+    dynarray_init(&scopes->undo, sizeof(struct Shadowed));
+    dynarray_init(&scopes->marks, sizeof(size_t));
 }
 
-struct TokenIterator {
-    struct Token *tokens;
-    size_t size;
-    size_t index;
-};
+static void ScopeStack_destroy(struct ScopeStack* scopes)
+{
+    free(scopes->bindings);
+    dynarray_destroy(&scopes->undo);
+    dynarray_destroy(&scopes->marks);
+}
 
-static void TokenIterator_init(struct TokenIterator* iter, struct Token* tokens, size_t size)
+static uint32_t ScopeStack_depth(const struct ScopeStack* scopes)
 {
-    iter->tokens = tokens;
-    iter->size = size;
-    iter->index = 0;
+    return dynarray_length(&scopes->marks);
 }
 
-static bool consume(struct TokenIterator* iter, enum TokenType kind)
+static void ScopeStack_push(struct ScopeStack* scopes)
 {
-    if (iter->index < iter->size && iter->tokens[iter->index].kind == kind) {
-        iter->index++;
-        return true;
+    size_t mark = dynarray_length(&scopes->undo);
+    dynarray_push(&scopes->marks, &mark);
+}
+
+/// Restore the bindings that the innermost scope shadowed, newest first
+static void ScopeStack_pop(struct ScopeStack* scopes)
+{
+    size_t mark = *(size_t*)dynarray_get(&scopes->marks, dynarray_length(&scopes->marks) - 1);
+    dynarray_pop(&scopes->marks);
+
+    while (dynarray_length(&scopes->undo) > mark) {
+        const struct Shadowed* shadowed = dynarray_get(&scopes->undo, dynarray_length(&scopes->undo) - 1);
+        scopes->bindings[shadowed->sym] = shadowed->previous;
+        dynarray_pop(&scopes->undo);
     }
-    return false;
 }
 
-static struct Token* consume_tok(struct TokenIterator* iter, enum TokenType kind)
+/// The visible declaration of sym, or NO_DECL
+static uint32_t ScopeStack_find(const struct ScopeStack* scopes, unsigned int sym)
 {
-    if (iter->index < iter->size && iter->tokens[iter->index].kind == kind) {
-        struct Token* tok = &iter->tokens[iter->index];
-        iter->index++;
-        return tok;
+    if (sym >= scopes->capacity) {
+        return NO_DECL;
     }
-    return NULL;
+    return scopes->bindings[sym].decl;
 }
 
-static bool consume_keyword(struct TokenIterator* iter, const char* kw)
+/// Add the declaration to the symbol table and bind it in the innermost scope, return its index. offset
+/// is where the identifier is declared, for the error
+static uint32_t ScopeStack_declare(struct ScopeStack* scopes, struct SymbolTable* symbols, const struct Declaration* var,
+                                   struct SourceFile* source, uint32_t offset)
 {
-    if (iter->index < iter->size && iter->tokens[iter->index].kind == TOK_IDENT && strcmp(iter->tokens[iter->index].data.ident, kw) == 0) {
-        iter->index++;
-        return true;
+    // interned IDs are dense, so the bindings can be indexed by them directly
+    if (var->sym >= scopes->capacity) {
+        size_t capacity = scopes->capacity ? scopes->capacity : 64;
+        while (capacity <= var->sym) {
+            capacity *= 2;
+        }
+        scopes->bindings = realloc(scopes->bindings, capacity * sizeof(struct Binding));
+        for (size_t i = scopes->capacity; i < capacity; i++) {
+            scopes->bindings[i].decl = NO_DECL;
+            scopes->bindings[i].depth = 0;
+        }
+        scopes->capacity = capacity;
     }
 
-    return false;
+    struct Binding* binding = &scopes->bindings[var->sym];
+    uint32_t depth = ScopeStack_depth(scopes);
+    if (binding->decl != NO_DECL && binding->depth == depth) {
+        SourceFile_error(source, offset, "Identifier already declared in this scope: %s", var->ident);
+    }
+
+    struct Shadowed shadowed;
+    shadowed.sym = var->sym;
+    shadowed.previous = *binding;
+    dynarray_push(&scopes->undo, &shadowed);
+
+    binding->decl = SymbolTable_add(symbols, var);
+    binding->depth = depth;
+    return binding->decl;
 }
 
-// TODO: add error message
-static void expect(struct TokenIterator* iter, enum TokenType kind)
+void ASTNode_init(struct ASTNode* node, enum NodeKind kind)
 {
-    if (iter->index < iter->size && iter->tokens[iter->index].kind == kind) {
-        iter->index++;
-    } else {
-        fprintf(stderr, "Expected token type %d, got %d instead\n", kind, iter->tokens[iter->index].kind);
-        exit(1);
-    }
+    node->kind = kind;
+    node->child_count = 0;
+    node->children = NULL;
 }
 
-static int64_t expect_int(struct TokenIterator* iter)
+struct ASTNode* ASTNode_new(struct Arena* arena, enum NodeKind kind, uint32_t child_count)
 {
-    if (iter->index < iter->size && iter->tokens[iter->index].kind == TOK_INT) {
-        int64_t val = iter->tokens[iter->index].data.i64;
-        iter->index++;
-        return val;
-    }
+    // the children pointers follow the node in the same allocation
+    struct ASTNode* node = Arena_alloc(arena, sizeof(struct ASTNode) + child_count * sizeof(struct ASTNode*));
+    node->kind = kind;
+    node->child_count = child_count;
+    node->children = (struct ASTNode**)(node + 1);
+    return node;
+}
 
-    fprintf(stderr, "Expected int, got token kind %d instead\n", iter->tokens[iter->index].kind);
-    exit(1);
+static struct ASTNode* new_unary(struct Context ctx, enum NodeKind kind, struct ASTNode* child)
+{
+    struct ASTNode* node = ASTNode_new(ctx.arena, kind, 1);
+    node->children[0] = child;
+    return node;
 }
 
-static bool has_next(struct TokenIterator* iter) {
-    return iter->index < iter->size;
+static struct ASTNode* new_binary(struct Context ctx, enum NodeKind kind, struct ASTNode* left, struct ASTNode* right)
+{
+    struct ASTNode* node = ASTNode_new(ctx.arena, kind, 2);
+    node->children[0] = left;
+    node->children[1] = right;
+    return node;
 }
 
-static bool peek(struct TokenIterator* iter, enum TokenType kind) {
-    return iter->index < iter->size && iter->tokens[iter->index].kind == kind;
+static struct ASTNode* new_int(struct Context ctx, int64_t value)
+{
+    struct ASTNode* node = ASTNode_new(ctx.arena, NODE_INT, 0);
+    node->data.i64 = value;
+    return node;
 }
 
-static bool peek_keyword(struct TokenIterator* iter, const char* kw) {
-    if (iter->index < iter->size && iter->tokens[iter->index].kind == TOK_IDENT && strcmp(iter->tokens[iter->index].data.ident, kw) == 0) {
-        return true;
+/// Make a node whose children are the statements pushed to ctx.pending since it had length base
+static struct ASTNode* take_pending(struct Context ctx, enum NodeKind kind, size_t base)
+{
+    size_t count = dynarray_length(ctx.pending) - base;
+    struct ASTNode* node = ASTNode_new(ctx.arena, kind, count);
+    for (size_t i = 0; i < count; i++) {
+        node->children[i] = *(struct ASTNode**)dynarray_get(ctx.pending, base + i);
     }
-
-    return false;
+    while (dynarray_length(ctx.pending) > base) {
+        dynarray_pop(ctx.pending);
+    }
+    return node;
 }
 
-static struct ASTNode expr(struct TokenIterator* iter, struct Context ctx);
+// the grammar needs a single token of lookahead, a few more make the ring cheap to index
+#define LOOKAHEAD 4
 
-const char* reserved_identifiers[] = {
-        "else",
-        "for",
-        "if",
-        "int",
-        "return",
-        "while",
-        NULL
+/// Pulls tokens from the lexer as the parser needs them, only the lookahead is stored. When the
+/// input was lexed in parallel, they come from that array instead
+struct TokenIterator {
+    struct SourceFile* source;
+    struct Lexer lexer;
+    const struct TokenStream* lexed; // or NULL
+    size_t lexed_index;
+    struct Token ring[LOOKAHEAD];
+    unsigned int head; // the current token in ring
+    unsigned int count; // tokens lexed and not consumed yet, from head
+    bool lexer_done;
 };
 
-static bool is_reserved(char* ident)
+static void TokenIterator_init(struct TokenIterator* iter, struct SourceFile* source, const struct TokenStream* lexed)
 {
-    for (unsigned int i = 0; reserved_identifiers[i] != NULL; i++) {
-        if (strcmp(ident, reserved_identifiers[i]) == 0) {
-            return true;
-        }
-    }
-    return false;
+    iter->source = source;
+    Lexer_init(&iter->lexer, source);
+    iter->lexed = lexed;
+    iter->lexed_index = 0;
+    iter->head = 0;
+    iter->count = 0;
+    iter->lexer_done = false;
 }
 
-static bool is_lvalue(struct ASTNode node)
+static bool next_token(struct TokenIterator* iter, struct Token* tok)
 {
-    return node.kind == NODE_IDENT && node.data.decl.kind == DECL_VARIABLE;
+    if (!iter->lexed) {
+        return Lexer_next(&iter->lexer, tok);
+    }
+    if (iter->lexed_index == TokenStream_length(iter->lexed)) {
+        return false;
+    }
+    TokenStream_get(iter->lexed, iter->lexed_index++, tok);
+    if (tok->kind == TOK_ERROR) {
+        SourceFile_error(iter->source, tok->offset, "%s", iter->lexed->error);
+    }
+    return true;
 }
 
-static void check_lvalue(struct ASTNode node)
+/// The token n positions after the current one, or NULL past the end of the input
+static const struct Token* lookahead(struct TokenIterator* iter, unsigned int n)
 {
-    if (!is_lvalue(node)) {
-        fprintf(stderr, "Expected lvalue");
-        exit(1);
+    ASSERT(n < LOOKAHEAD)
+    while (iter->count <= n && !iter->lexer_done) {
+        if (next_token(iter, &iter->ring[(iter->head + iter->count) % LOOKAHEAD])) {
+            iter->count++;
+        } else {
+            iter->lexer_done = true;
+        }
     }
+    return (n < iter->count) ? &iter->ring[(iter->head + n) % LOOKAHEAD] : NULL;
 }
 
-static void check_modifiable_lvalue(struct ASTNode node)
+static const struct Token* current(struct TokenIterator* iter)
 {
-    check_lvalue(node);
+    return lookahead(iter, 0);
 }
 
-// primary = '(' expr ')' | ident | int
-static struct ASTNode primary(struct TokenIterator* iter, struct Context ctx)
+static void advance(struct TokenIterator* iter)
 {
-    struct ASTNode node;
-
-    struct Token* tok;
-    if (consume(iter, TOK_LEFT_PAREN)) {
-        node = expr(iter, ctx);
-        expect(iter,TOK_RIGHT_PAREN);
-    } else if ((tok = consume_tok(iter, TOK_IDENT))) {
-        if (is_reserved(tok->data.ident)) {
-            fprintf(stderr, "Unexpected reserved identifier\n");
-            exit(1);
-        } else {
-            ASTNode_init(&node, NODE_IDENT);
-            if (!Scope_find(ctx.scope, tok->data.ident, &node.data.decl)) {
-                fprintf(stderr, "Unknown identifier: %s\n", tok->data.ident);
-                exit(1);
-            }
-        }
-    } else {
-        node.data.i64 = expect_int(iter);
-        dynarray_init(&node.children, sizeof(struct ASTNode));
-        node.kind = NODE_INT;
-    }
-
-    return node;
+    ASSERT(iter->count > 0)
+    iter->head = (iter->head + 1) % LOOKAHEAD;
+    iter->count--;
 }
 
-// postfix_expr = primary ('++')*
-static struct ASTNode postfix_expr(struct TokenIterator* iter, struct Context ctx)
+/// For error messages, -1 at the end of the input
+static int current_kind(struct TokenIterator* iter)
 {
-    struct ASTNode node = primary(iter, ctx);
+    const struct Token* tok = current(iter);
+    return tok ? tok->kind : -1;
+}
 
-    while (has_next(iter)) {
-        if (consume(iter, TOK_INCREMENT)) {
-            check_modifiable_lvalue(node);
+/// Where to report an error about the current token
+static uint32_t error_offset(struct TokenIterator* iter)
+{
+    const struct Token* tok = current(iter);
+    return tok ? tok->offset : iter->source->size;
+}
 
-            struct ASTNode parent;
-            ASTNode_init(&parent, NODE_POSTFIX_INCREMENT);
-            dynarray_push(&parent.children, &node);
-            node = parent;
-        } else {
-            break;
-        }
-    }
+static bool has_next(struct TokenIterator* iter) {
+    return current(iter) != NULL;
+}
 
-    return node;
+static bool peek(struct TokenIterator* iter, enum TokenType kind) {
+    const struct Token* tok = current(iter);
+    return tok && tok->kind == kind;
 }
 
-// mul_div = postfix_expr ( ('*' | '/') postfix_expr)*
-static struct ASTNode mul_div(struct TokenIterator* iter, struct Context ctx)
+static bool consume(struct TokenIterator* iter, enum TokenType kind)
 {
-    struct ASTNode node = postfix_expr(iter, ctx);
+    if (peek(iter, kind)) {
+        advance(iter);
+        return true;
+    }
+    return false;
+}
 
-    while (has_next(iter)) {
-        if (consume(iter, TOK_MUL)) {
-            struct ASTNode parent;
-            ASTNode_init_binary(&parent, NODE_MUL, node, postfix_expr(iter, ctx));
-            node = parent;
-        } else if (consume(iter, TOK_DIV)) {
-            struct ASTNode parent;
-            ASTNode_init_binary(&parent, NODE_DIV, node, postfix_expr(iter, ctx));
-            node = parent;
-        } else {
-            break;
-        }
+/// Consume an identifier and write its symbol to sym
+static bool consume_ident(struct TokenIterator* iter, unsigned int* sym)
+{
+    if (peek(iter, TOK_IDENT)) {
+        *sym = current(iter)->data.ident;
+        advance(iter);
+        return true;
     }
+    return false;
+}
 
-    return node;
+// TODO: add error message
+static void expect(struct TokenIterator* iter, enum TokenType kind)
+{
+    if (peek(iter, kind)) {
+        advance(iter);
+    } else {
+        SourceFile_error(iter->source, error_offset(iter), "Expected token type %d, got %d instead", kind, current_kind(iter));
+    }
 }
 
-// add_sub = mul_div ( (+ | -) mul_div)*
-static struct ASTNode add_sub(struct TokenIterator* iter, struct Context ctx)
+static unsigned int expect_ident(struct TokenIterator* iter)
 {
-    struct ASTNode node = mul_div(iter, ctx);
+    unsigned int sym;
+    if (!consume_ident(iter, &sym)) {
+        SourceFile_error(iter->source, error_offset(iter), "Expected an identifier");
+    }
+    return sym;
+}
 
-    while (has_next(iter)) {
-        if (consume(iter, TOK_ADD)) {
-            struct ASTNode parent;
-            ASTNode_init_binary(&parent, NODE_ADD, node, mul_div(iter, ctx));
-            node = parent;
-        } else if (consume(iter, TOK_SUB)) {
-            struct ASTNode parent;
-            ASTNode_init_binary(&parent, NODE_SUB, node, mul_div(iter, ctx));
-            node = parent;
-        } else {
-            break;
-        }
+static int64_t expect_int(struct TokenIterator* iter)
+{
+    if (peek(iter, TOK_INT)) {
+        int64_t val = current(iter)->data.i64;
+        advance(iter);
+        return val;
     }
 
-    return node;
+    SourceFile_error(iter->source, error_offset(iter), "Expected int, got token kind %d instead", current_kind(iter));
 }
 
-// relational_expr = add_sub ( '<' add_sub )*
-static struct ASTNode relational_expr(struct TokenIterator* iter, struct Context ctx)
+static struct ASTNode* expr(struct TokenIterator* iter, struct Context ctx);
+
+static bool is_lvalue(const struct ASTNode* node, struct Context ctx)
 {
-    struct ASTNode node = add_sub(iter, ctx);
+    return node->kind == NODE_IDENT && SymbolTable_get(ctx.symbols, node->data.decl)->kind == DECL_VARIABLE;
+}
 
-    while (consume(iter, TOK_LESS_THAN)) {
-        struct ASTNode parent;
-        ASTNode_init_binary(&parent, NODE_LESS_THAN, node, add_sub(iter, ctx));
-        node = parent;
+/// offset is where the expression of node starts
+static void check_lvalue(struct TokenIterator* iter, const struct ASTNode* node, uint32_t offset, struct Context ctx)
+{
+    if (!is_lvalue(node, ctx)) {
+        SourceFile_error(iter->source, offset, "Expected lvalue");
     }
+}
 
-    return node;
+static void check_modifiable_lvalue(struct TokenIterator* iter, const struct ASTNode* node, uint32_t offset, struct Context ctx)
+{
+    check_lvalue(iter, node, offset, ctx);
 }
 
-// equality_expr = relational_expr ( '==' relational_expr )*
-static struct ASTNode equality_expr(struct TokenIterator* iter, struct Context ctx)
+enum BindingPower {
+    BP_NONE, // not an infix or postfix operator, ends the expression
+    BP_ASSIGN,
+    BP_EQUALITY,
+    BP_RELATIONAL,
+    BP_ADDITIVE,
+    BP_MULTIPLICATIVE,
+    BP_POSTFIX,
+};
+
+struct Operator {
+    uint8_t bp; // enum BindingPower
+    uint8_t node_kind; // enum NodeKind
+    bool right_assoc;
+};
+
+// indexed by token kind, the tokens that aren't operators are left at BP_NONE
+static const struct Operator operators[TOK_COUNT] = {
+    [TOK_ASSIGN] = {BP_ASSIGN, NODE_ASSIGN, true},
+    [TOK_ASSIGN_ADD] = {BP_ASSIGN, NODE_ASSIGN_ADD, true},
+    [TOK_EQUALS] = {BP_EQUALITY, NODE_EQUALS, false},
+    [TOK_LESS_THAN] = {BP_RELATIONAL, NODE_LESS_THAN, false},
+    [TOK_ADD] = {BP_ADDITIVE, NODE_ADD, false},
+    [TOK_SUB] = {BP_ADDITIVE, NODE_SUB, false},
+    [TOK_MUL] = {BP_MULTIPLICATIVE, NODE_MUL, false},
+    [TOK_DIV] = {BP_MULTIPLICATIVE, NODE_DIV, false},
+    [TOK_INCREMENT] = {BP_POSTFIX, NODE_POSTFIX_INCREMENT, false},
+};
+
+// primary = '(' expr ')' | ident | int
+static struct ASTNode* primary(struct TokenIterator* iter, struct Context ctx)
 {
-    struct ASTNode node = relational_expr(iter, ctx);
+    struct ASTNode* node;
 
-    while (consume(iter, TOK_EQUALS)) {
-        struct ASTNode parent;
-        ASTNode_init_binary(&parent, NODE_EQUALS, node, relational_expr(iter, ctx));
-        node = parent;
+    unsigned int sym;
+    if (consume(iter, TOK_LEFT_PAREN)) {
+        node = expr(iter, ctx);
+        expect(iter,TOK_RIGHT_PAREN);
+    } else if (peek(iter, TOK_IDENT)) {
+        uint32_t offset = error_offset(iter);
+        consume_ident(iter, &sym);
+        node = ASTNode_new(ctx.arena, NODE_IDENT, 0);
+        node->data.decl = ScopeStack_find(ctx.scopes, sym);
+        if (node->data.decl == NO_DECL) {
+            SourceFile_error(iter->source, offset, "Unknown identifier: %s", intern_string(sym));
+        }
+    } else {
+        node = new_int(ctx, expect_int(iter));
     }
 
     return node;
 }
 
-// assign = equality_expr ( ('=' | '+=') equality_expr )
-static struct ASTNode assign_expr(struct TokenIterator* iter, struct Context ctx)
+/// Parse a primary followed by the operators that bind at least as tightly as min_bp. Each operator
+/// is one table lookup, so a literal costs the same however many precedence levels there are
+static struct ASTNode* expr_bp(struct TokenIterator* iter, struct Context ctx, unsigned int min_bp)
 {
-    struct ASTNode lhs = equality_expr(iter, ctx);
+    uint32_t lhs_offset = error_offset(iter);
+    struct ASTNode* lhs = primary(iter, ctx);
 
-    enum NodeKind kind;
+    for (;;) {
+        int kind = current_kind(iter);
+        if (kind < 0) {
+            break;
+        }
 
-    if (consume(iter, TOK_ASSIGN)) {
-        kind = NODE_ASSIGN;
-    } else if (consume(iter, TOK_ASSIGN_ADD)) {
-        kind = NODE_ASSIGN_ADD;
-    } else {
-        return lhs;
-    }
+        const struct Operator* op = &operators[kind];
+        if (op->bp == BP_NONE || op->bp < min_bp) {
+            break;
+        }
+        advance(iter);
 
-    check_lvalue(lhs);
-    struct ASTNode rhs = assign_expr(iter, ctx);
-    struct ASTNode node;
+        if (op->bp == BP_POSTFIX) {
+            check_modifiable_lvalue(iter, lhs, lhs_offset, ctx);
+            lhs = new_unary(ctx, op->node_kind, lhs);
+            continue;
+        }
 
-    ASTNode_init_binary(&node, kind, lhs, rhs);
-    return node;
+        if (op->bp == BP_ASSIGN) {
+            check_lvalue(iter, lhs, lhs_offset, ctx);
+        }
+        struct ASTNode* rhs = expr_bp(iter, ctx, op->right_assoc ? op->bp : op->bp + 1);
+        lhs = new_binary(ctx, op->node_kind, lhs, rhs);
+    }
+
+    return lhs;
 }
 
-// expr = assign_expr
-static struct ASTNode expr(struct TokenIterator* iter, struct Context ctx)
+// expr = primary ( binary_op expr | '++' )*, with the precedence and associativity from operators
+static struct ASTNode* expr(struct TokenIterator* iter, struct Context ctx)
 {
-    return assign_expr(iter, ctx);
+    return expr_bp(iter, ctx, BP_ASSIGN);
 }
 
-static struct ASTNode expr_statement(struct TokenIterator* iter, struct Context ctx)
+static struct ASTNode* expr_statement(struct TokenIterator* iter, struct Context ctx)
 {
-    struct ASTNode node;
-    ASTNode_init(&node, NODE_EXPR_STMT);
-
-    struct ASTNode child = expr(iter, ctx);
-    dynarray_push(&node.children, &child);
-
+    struct ASTNode* node = new_unary(ctx, NODE_EXPR_STMT, expr(iter, ctx));
     expect(iter, TOK_SEMICOLON);
     return node;
 }
 
-static struct ASTNode compound_statement(struct TokenIterator* iter, struct Context ctx);
+static struct ASTNode* compound_statement(struct TokenIterator* iter, struct Context ctx);
 
 // statement = 'return' expr ';'
 //           | 'if' '(' expr ')' statement ( 'else' statement )?
 //           | 'while' '(' expr ')' statement
 //           | 'for' '(' (declaration | ( expr ';'))? expr? ';' expr? ')' statement
-//           | 'int' ident ( '=' assign_expr )? ';'
+//           | 'int' ident ( '=' expr )? ';'
 //           | compound_statement
 //           | expr_statement
-static struct ASTNode statement(struct TokenIterator* iter, struct Context ctx)
+static struct ASTNode* statement(struct TokenIterator* iter, struct Context ctx)
 {
-    struct ASTNode node;
-    if (consume_keyword(iter, "return")) {
-        ASTNode_init(&node, NODE_RETURN);
-
-        struct ASTNode child = expr(iter, ctx);
-        dynarray_push(&node.children, &child);
-        expect(iter, TOK_SEMICOLON);
-    } else if (consume_keyword(iter, "if")) {
-        ASTNode_init(&node, NODE_IF);
-        expect(iter, TOK_LEFT_PAREN);
-        struct ASTNode cond = expr(iter, ctx);
-        expect(iter, TOK_RIGHT_PAREN);
-        struct ASTNode body = statement(iter, ctx);
-        dynarray_push(&node.children, &cond);
-        dynarray_push(&node.children, &body);
-
-        if (consume_keyword(iter, "else")) {
-            struct ASTNode else_body = statement(iter, ctx);
-            dynarray_push(&node.children, &else_body);
-        }
-    } else if (consume_keyword(iter, "while")) {
-        ASTNode_init(&node, NODE_WHILE);
-        expect(iter, TOK_LEFT_PAREN);
-        struct ASTNode cond = expr(iter, ctx);
-        expect(iter, TOK_RIGHT_PAREN);
-        struct ASTNode body = statement(iter, ctx);
-        dynarray_push(&node.children, &cond);
-        dynarray_push(&node.children, &body);
-    } else if (consume_keyword(iter, "for")) {
-        ASTNode_init(&node, NODE_FOR);
-        expect(iter, TOK_LEFT_PAREN);
+    if (!has_next(iter)) {
+        SourceFile_error(iter->source, error_offset(iter), "Unexpected end of input, expected a statement");
+    }
 
-        struct Scope for_scope;
-        Scope_init(&for_scope, ctx.scope);
-        ctx.scope = &for_scope;
-
-        struct ASTNode init;
-        if (consume(iter, TOK_SEMICOLON)) {
-            ASTNode_init(&init, NODE_INT);
-            init.data.i64 = 0;
-        } else if (peek_keyword(iter, "int")) {
-            init = statement(iter, ctx);
-            ASSERT(init.kind == NODE_DECL);
-        } else {
-            init = expr(iter, ctx);
+    struct ASTNode* node;
+    switch(current(iter)->kind) {
+        case TOK_KW_RETURN:
+        {
+            advance(iter);
+            node = new_unary(ctx, NODE_RETURN, expr(iter, ctx));
             expect(iter, TOK_SEMICOLON);
+            break;
         }
-        dynarray_push(&node.children, &init);
 
-        struct ASTNode cond;
-        if (consume(iter, TOK_SEMICOLON)) {
-            ASTNode_init(&cond, NODE_INT);
-            cond.data.i64 = 1;
-        } else {
-            cond = expr(iter, ctx);
-            expect(iter, TOK_SEMICOLON);
+        case TOK_KW_IF:
+        {
+            advance(iter);
+            expect(iter, TOK_LEFT_PAREN);
+            struct ASTNode* cond = expr(iter, ctx);
+            expect(iter, TOK_RIGHT_PAREN);
+            struct ASTNode* body = statement(iter, ctx);
+
+            if (consume(iter, TOK_KW_ELSE)) {
+                struct ASTNode* else_body = statement(iter, ctx);
+                node = ASTNode_new(ctx.arena, NODE_IF, 3);
+                node->children[2] = else_body;
+            } else {
+                node = ASTNode_new(ctx.arena, NODE_IF, 2);
+            }
+            node->children[0] = cond;
+            node->children[1] = body;
+            break;
         }
-        dynarray_push(&node.children, &cond);
 
-        struct ASTNode increment;
-        if (consume(iter, TOK_RIGHT_PAREN)) {
-            ASTNode_init(&increment, NODE_INT);
-            increment.data.i64 = 0;
-        } else {
-            increment = expr(iter, ctx);
+        case TOK_KW_WHILE:
+        {
+            advance(iter);
+            expect(iter, TOK_LEFT_PAREN);
+            struct ASTNode* cond = expr(iter, ctx);
             expect(iter, TOK_RIGHT_PAREN);
+            struct ASTNode* body = statement(iter, ctx);
+            node = new_binary(ctx, NODE_WHILE, cond, body);
+            break;
         }
-        dynarray_push(&node.children, &increment);
 
-        struct ASTNode body = statement(iter, ctx);
-        dynarray_push(&node.children, &body);
-    } else if (consume_keyword(iter, "int")) {
-        ASTNode_init(&node, NODE_DECL);
-        struct Token* ident = consume_tok(iter, TOK_IDENT);
+        case TOK_KW_FOR:
+        {
+            advance(iter);
+            node = ASTNode_new(ctx.arena, NODE_FOR, 4);
+            expect(iter, TOK_LEFT_PAREN);
+
+            ScopeStack_push(ctx.scopes);
+
+            struct ASTNode* init;
+            if (consume(iter, TOK_SEMICOLON)) {
+                init = new_int(ctx, 0);
+            } else if (peek(iter, TOK_KW_INT)) {
+                init = statement(iter, ctx);
+                ASSERT(init->kind == NODE_DECL);
+            } else {
+                init = expr(iter, ctx);
+                expect(iter, TOK_SEMICOLON);
+            }
+            node->children[0] = init;
+
+            struct ASTNode* cond;
+            if (consume(iter, TOK_SEMICOLON)) {
+                cond = new_int(ctx, 1);
+            } else {
+                cond = expr(iter, ctx);
+                expect(iter, TOK_SEMICOLON);
+            }
+            node->children[1] = cond;
+
+            struct ASTNode* increment;
+            if (consume(iter, TOK_RIGHT_PAREN)) {
+                increment = new_int(ctx, 0);
+            } else {
+                increment = expr(iter, ctx);
+                expect(iter, TOK_RIGHT_PAREN);
+            }
+            node->children[2] = increment;
+
+            node->children[3] = statement(iter, ctx);
+            ScopeStack_pop(ctx.scopes);
+            break;
+        }
 
-        if (consume(iter, TOK_ASSIGN)) {
-            struct ASTNode rhs = assign_expr(iter, ctx);
+        case TOK_KW_INT:
+        {
+            advance(iter);
+            uint32_t offset = error_offset(iter);
+            unsigned int sym;
+            if (!consume_ident(iter, &sym)) {
+                SourceFile_error(iter->source, error_offset(iter), "Expected an identifier after int");
+            }
 
-            struct ASTNode assign;
-            ASTNode_init(&assign, NODE_ASSIGN);
+            if (consume(iter, TOK_ASSIGN)) {
+                node = new_unary(ctx, NODE_DECL, expr(iter, ctx));
+            } else {
+                node = ASTNode_new(ctx.arena, NODE_DECL, 0);
+            }
 
-            struct ASTNode lvalue;
-            ASTNode_init(&lvalue, NODE_IDENT);
-            dynarray_push(&node.children, &rhs);
+            expect(iter, TOK_SEMICOLON);
+            struct Declaration decl;
+            decl.sym = sym;
+            decl.ident = intern_string(sym);
+            decl.type = Type_int();
+            decl.kind = DECL_VARIABLE;
+            // the slot is [rbp-stack_loc, rbp), [rbp] holds the caller's rbp
+            *ctx.frame_size += 8;
+            decl.data.var.stack_loc = *ctx.frame_size;
+            node->data.decl = ScopeStack_declare(ctx.scopes, ctx.symbols, &decl, iter->source, offset);
+            break;
         }
 
-        expect(iter, TOK_SEMICOLON);
-        node.data.decl.ident = ident->data.ident;
-        node.data.decl.type = Type_int();
-        node.data.decl.kind = DECL_VARIABLE;
-        node.data.decl.data.var.stack_loc = *ctx.frame_size;
-        *ctx.frame_size += 8;
-        Scope_append(ctx.scope, &node.data.decl);
-    } else if (peek(iter, TOK_LEFT_CURLY_BRACKET)) {
-        node = compound_statement(iter, ctx);
-    } else {
-        node = expr_statement(iter, ctx);
+        case TOK_LEFT_CURLY_BRACKET:
+            node = compound_statement(iter, ctx);
+            break;
+
+        default:
+            node = expr_statement(iter, ctx);
+            break;
     }
     return node;
 }
 
-// compound_statement = '{' statement* '}'
-static struct ASTNode compound_statement(struct TokenIterator* iter, struct Context ctx)
+/// '{' statement* '}' in the current scope
+static struct ASTNode* block_items(struct TokenIterator* iter, struct Context ctx)
 {
     expect(iter, TOK_LEFT_CURLY_BRACKET);
 
-    struct ASTNode node;
-    ASTNode_init(&node, NODE_BLOCK);
-
-    // TODO: use a better datastructure
-    struct Scope* scope = malloc(sizeof(struct Scope));
-    Scope_init(scope, ctx.scope);
-
-    struct Context block_ctx = ctx;
-    ctx.scope = scope;
-
+    size_t base = dynarray_length(ctx.pending);
     while (!consume(iter, TOK_RIGHT_CURLY_BRACKET)) {
-        struct ASTNode child = statement(iter, block_ctx);
-        dynarray_push(&node.children, &child);
+        struct ASTNode* child = statement(iter, ctx);
+        dynarray_push(ctx.pending, &child);
     }
 
-    return node;
+    return take_pending(ctx, NODE_BLOCK, base);
 }
 
-static struct ASTNode function_definition(struct TokenIterator* iter, struct Scope* scope)
+// compound_statement = '{' statement* '}'
+static struct ASTNode* compound_statement(struct TokenIterator* iter, struct Context ctx)
 {
-    if (consume_keyword(iter, "int")) {
-        struct Token* tok = consume_tok(iter, TOK_IDENT);
+    ScopeStack_push(ctx.scopes);
+    struct ASTNode* node = block_items(iter, ctx);
+    ScopeStack_pop(ctx.scopes);
+    return node;
+}
 
+static struct ASTNode* function_definition(struct TokenIterator* iter, struct Context ctx)
+{
+    if (consume(iter, TOK_KW_INT)) {
         struct Declaration decl;
-        decl.ident = tok->data.ident;
+        uint32_t offset = error_offset(iter);
+        decl.sym = expect_ident(iter);
+        decl.ident = intern_string(decl.sym);
         decl.kind = DECL_FUNCTION;
         decl.data.fun.frame_size = 0;
 
         expect(iter, TOK_LEFT_PAREN);
 
-        struct Scope fun_scope;
-        Scope_init(&fun_scope, scope);
+        // we have to declare the function before parsing the body even though we don't know the frame size yet
+        // otherwise we can't handle recursion
+        uint32_t index = ScopeStack_declare(ctx.scopes, ctx.symbols, &decl, iter->source, offset);
+
+        // the parameters and the outermost block of the body share a scope
+        ScopeStack_push(ctx.scopes);
 
         while (!consume(iter, TOK_RIGHT_PAREN)) {
-            if (!consume_keyword(iter, "int")) {
-                fprintf(stderr, "invalid parameter declaration\n");
-                exit(1);
+            if (!consume(iter, TOK_KW_INT)) {
+                SourceFile_error(iter->source, error_offset(iter), "invalid parameter declaration");
             }
 
-            struct Token* param = consume_tok(iter, TOK_IDENT);
-
             struct Declaration param_decl;
             param_decl.kind = DECL_VARIABLE;
-            param_decl.ident = param->data.ident;
+            uint32_t param_offset = error_offset(iter);
+            param_decl.sym = expect_ident(iter);
+            param_decl.ident = intern_string(param_decl.sym);
 
-            param_decl.data.var.stack_loc = decl.data.fun.frame_size;
             decl.data.fun.frame_size += 8;
+            param_decl.data.var.stack_loc = decl.data.fun.frame_size;
 
-            Scope_append(&fun_scope, &param_decl);
+            ScopeStack_declare(ctx.scopes, ctx.symbols, &param_decl, iter->source, param_offset);
 
             consume(iter, TOK_COMMA);
         }
 
-        struct Context ctx;
-        ctx.scope = &fun_scope;
         ctx.frame_size = &decl.data.fun.frame_size;
 
-        // we have to declare the function before parsing the body even though we don't know the frame size yet
-        // otherwise we can't handle recursion
-        Scope_append(scope, &decl);
-
-        struct ASTNode body = compound_statement(iter, ctx);
+        struct ASTNode* body = block_items(iter, ctx);
+        ScopeStack_pop(ctx.scopes);
 
-        // overwrite the declaration with the correct frame size
-        hashmap_set(&scope->decls, tok->data.ident, &decl);
-
-        struct ASTNode node;
-        ASTNode_init(&node, NODE_FUNCTION_DEF);
-        node.data.decl = decl;
-        dynarray_push(&node.children, &body);
+        // fill in the frame size now that it is known
+        SymbolTable_get(ctx.symbols, index)->data.fun.frame_size = decl.data.fun.frame_size;
 
+        struct ASTNode* node = new_unary(ctx, NODE_FUNCTION_DEF, body);
+        node->data.decl = index;
         return node;
     } else {
-        fprintf(stderr, "expected function definition\n");
-        exit(1);
+        SourceFile_error(iter->source, error_offset(iter), "expected function definition");
     }
 }
 
 // program = statement*
-struct ASTNode parse(struct dynarray tokens)
+struct ASTNode* parse(struct SourceFile* source, unsigned int lex_threads, struct Arena* arena, struct SymbolTable* symbols)
 {
+    struct TokenStream lexed;
+    if (lex_threads > 1) {
+        lex_parallel(source, lex_threads, &lexed);
+    }
+
     struct TokenIterator iter;
-    TokenIterator_init(&iter, (struct Token*)tokens.data, dynarray_length(&tokens));
-    struct ASTNode program;
-    program.kind = NODE_PROGRAM;
-    dynarray_init(&program.children, sizeof(struct ASTNode));
+    TokenIterator_init(&iter, source, (lex_threads > 1) ? &lexed : NULL);
+
+    struct ScopeStack scopes;
+    ScopeStack_init(&scopes);
+    struct dynarray pending;
+    dynarray_init(&pending, sizeof(struct ASTNode*));
+
+    struct Context ctx;
+    ctx.scopes = &scopes;
+    ctx.frame_size = NULL;
+    ctx.symbols = symbols;
+    ctx.arena = arena;
+    ctx.pending = &pending;
 
-    struct Scope scope;
-    Scope_init(&scope, NULL);
     while(has_next(&iter)) {
-        //struct ASTNode node = statement(&iter, &scope);
-        struct ASTNode node = function_definition(&iter, &scope);
-        dynarray_push(&program.children, &node);
+        struct ASTNode* node = function_definition(&iter, ctx);
+        dynarray_push(&pending, &node);
     }
+    struct ASTNode* program = take_pending(ctx, NODE_PROGRAM, 0);
 
+    dynarray_destroy(&pending);
+    ScopeStack_destroy(&scopes);
+    if (lex_threads > 1) {
+        TokenStream_destroy(&lexed);
+    }
     return program;
 }
@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <string.h>
+#include "asm.h"
+#include "util.h"
+
+/// A pattern matches length consecutive instructions and replaces them with at most length others
+struct PeepholePattern {
+    const char* name;
+    size_t length;
+    /// Write the replacement to out and return its length, or return -1 if the pattern doesn't match
+    int (*rewrite)(const struct Instruction* in, struct Instruction* out);
+    unsigned int hits;
+};
+
+static bool same_operand(struct Operand a, struct Operand b)
+{
+    if (a.kind != b.kind) {
+        return false;
+    }
+
+    switch(a.kind) {
+        case OPERAND_NONE:
+            return true;
+        case OPERAND_IMM:
+            return a.data.imm == b.data.imm;
+        case OPERAND_LABEL:
+            return a.data.label == b.data.label;
+        case OPERAND_MEM:
+            return a.data.mem.base == b.data.mem.base && a.data.mem.disp == b.data.mem.disp;
+        case OPERAND_REG:
+            return a.data.reg == b.data.reg;
+    }
+
+    return false;
+}
+
+static bool mentions_reg(struct Operand op, unsigned int reg)
+{
+    return (op.kind == OPERAND_REG && op.data.reg == reg) || (op.kind == OPERAND_MEM && op.data.mem.base == reg);
+}
+
+/// mov r, r
+static int self_move(const struct Instruction* in, struct Instruction* out)
+{
+    (void)out;
+    if (in[0].op == ASM_MOV && in[0].operands[0].kind == OPERAND_REG && same_operand(in[0].operands[0], in[0].operands[1])) {
+        return 0;
+    }
+    return -1;
+}
+
+/// add r, 0 and sub r, 0, including the sub rsp, 0 of a function without locals or spills.
+/// The flags they set don't matter, every jcc and setcc we emit follows a cmp or a test
+static int add_zero(const struct Instruction* in, struct Instruction* out)
+{
+    (void)out;
+    if ((in[0].op == ASM_ADD || in[0].op == ASM_SUB) && in[0].operands[1].kind == OPERAND_IMM && in[0].operands[1].data.imm == 0) {
+        return 0;
+    }
+    return -1;
+}
+
+/// push a; pop a disappears, push a; pop b is mov b, a
+static int push_pop(const struct Instruction* in, struct Instruction* out)
+{
+    if (in[0].op != ASM_PUSH || in[1].op != ASM_POP) {
+        return -1;
+    }
+
+    struct Operand src = in[0].operands[0];
+    struct Operand dst = in[1].operands[0];
+    if (same_operand(src, dst)) {
+        return 0;
+    }
+    if (src.kind == OPERAND_MEM && dst.kind == OPERAND_MEM) {
+        return -1;
+    }
+
+    out[0] = in[1];
+    out[0].op = ASM_MOV;
+    out[0].operands[1] = src;
+    return 1;
+}
+
+/// mov a, b; mov b, a: the second one copies back the value b already has
+static int move_back(const struct Instruction* in, struct Instruction* out)
+{
+    if (in[0].op == ASM_MOV && in[1].op == ASM_MOV
+        && same_operand(in[0].operands[0], in[1].operands[1]) && same_operand(in[0].operands[1], in[1].operands[0])) {
+        out[0] = in[0];
+        return 1;
+    }
+    return -1;
+}
+
+/// mov r, a; mov r, b where b doesn't read r: the first value is never used
+static int dead_move(const struct Instruction* in, struct Instruction* out)
+{
+    if (in[0].op != ASM_MOV || in[1].op != ASM_MOV || in[0].operands[0].kind != OPERAND_REG) {
+        return -1;
+    }
+
+    unsigned int reg = in[0].operands[0].data.reg;
+    if (same_operand(in[0].operands[0], in[1].operands[0]) && !mentions_reg(in[1].operands[1], reg)) {
+        out[0] = in[1];
+        return 1;
+    }
+    return -1;
+}
+
+/// jmp L; L:
+static int jump_to_next(const struct Instruction* in, struct Instruction* out)
+{
+    if (in[0].op == ASM_JMP && in[1].op == ASM_LABEL && in[0].operands[0].data.label == in[1].operands[0].data.label) {
+        out[0] = in[1];
+        return 1;
+    }
+    return -1;
+}
+
+/// jcc L1; jmp L2; L1: becomes jncc L2; L1:
+static int jump_over_jump(const struct Instruction* in, struct Instruction* out)
+{
+    if (in[0].op == ASM_JCC && in[1].op == ASM_JMP && in[2].op == ASM_LABEL
+        && in[0].operands[0].data.label == in[2].operands[0].data.label) {
+        out[0] = in[0];
+        out[0].cond = invert_condition(in[0].cond);
+        out[0].operands[0] = in[1].operands[0];
+        out[1] = in[2];
+        return 2;
+    }
+    return -1;
+}
+
+#define MAX_PATTERN_LENGTH 3
+
+static struct PeepholePattern patterns[] = {
+    { "mov r, r", 1, self_move, 0 },
+    { "add/sub 0", 1, add_zero, 0 },
+    { "push; pop", 2, push_pop, 0 },
+    { "mov a, b; mov b, a", 2, move_back, 0 },
+    { "dead mov", 2, dead_move, 0 },
+    { "jmp to next label", 2, jump_to_next, 0 },
+    { "jcc over jmp", 3, jump_over_jump, 0 },
+};
+
+static const size_t pattern_count = sizeof(patterns) / sizeof(patterns[0]);
+
+static size_t instructions_before = 0;
+static size_t instructions_after = 0;
+
+/// One pass over the instructions [begin, end) of the function. frame_insn is updated, or set to
+/// SIZE_MAX if it was removed. Return whether any pattern matched
+static bool peephole_pass(const struct Instruction* insns, size_t begin, size_t end, size_t* frame_insn, struct dynarray* out)
+{
+    bool changed = false;
+    size_t new_frame_insn = SIZE_MAX;
+
+    size_t i = begin;
+    while (i < end) {
+        bool matched = false;
+        for (size_t p = 0; p < pattern_count && !matched; p++) {
+            struct PeepholePattern* pattern = &patterns[p];
+            if (i + pattern->length > end) {
+                continue;
+            }
+
+            struct Instruction replacement[MAX_PATTERN_LENGTH];
+            int count = pattern->rewrite(&insns[i], replacement);
+            if (count < 0) {
+                continue;
+            }
+
+            pattern->hits++;
+            for (int k = 0; k < count; k++) {
+                dynarray_push(out, &replacement[k]);
+            }
+            i += pattern->length;
+            matched = true;
+        }
+
+        if (matched) {
+            changed = true;
+        } else {
+            if (i == *frame_insn) {
+                new_frame_insn = dynarray_length(out);
+            }
+            dynarray_push(out, (void*)&insns[i]);
+            i++;
+        }
+    }
+
+    *frame_insn = new_frame_insn;
+    return changed;
+}
+
+void peephole(struct AsmBuffer* buf)
+{
+    instructions_before += dynarray_length(&buf->instructions);
+
+    struct dynarray out;
+    dynarray_init_with_capacity(&out, sizeof(struct Instruction), dynarray_length(&buf->instructions));
+    struct dynarray scratch;
+    dynarray_init(&scratch, sizeof(struct Instruction));
+
+    size_t copied = 0;
+    for (size_t f = 0; f < dynarray_length(&buf->functions); f++) {
+        struct AsmFunction* fun = dynarray_get(&buf->functions, f);
+
+        // instructions outside of any function are kept as they are
+        for (; copied < fun->begin; copied++) {
+            dynarray_push(&out, dynarray_get(&buf->instructions, copied));
+        }
+        copied = fun->end;
+
+        // removing an instruction can make a new pattern appear, repeat until nothing matches
+        const struct Instruction* insns = dynarray_get(&buf->instructions, 0);
+        size_t begin = fun->begin;
+        size_t end = fun->end;
+        size_t frame_insn = fun->frame_insn;
+        while (true) {
+            struct dynarray pass;
+            dynarray_init_with_capacity(&pass, sizeof(struct Instruction), end - begin);
+            bool changed = peephole_pass(insns, begin, end, &frame_insn, &pass);
+
+            dynarray_destroy(&scratch);
+            scratch = pass;
+            insns = dynarray_get(&scratch, 0);
+            begin = 0;
+            end = dynarray_length(&scratch);
+            if (!changed) {
+                break;
+            }
+        }
+
+        fun->begin = dynarray_length(&out);
+        fun->frame_insn = (frame_insn == SIZE_MAX) ? SIZE_MAX : fun->begin + frame_insn;
+        dynarray_append(&out, dynarray_get(&scratch, 0), end);
+        fun->end = dynarray_length(&out);
+    }
+
+    for (; copied < dynarray_length(&buf->instructions); copied++) {
+        dynarray_push(&out, dynarray_get(&buf->instructions, copied));
+    }
+
+    dynarray_destroy(&scratch);
+    dynarray_destroy(&buf->instructions);
+    buf->instructions = out;
+
+    instructions_after += dynarray_length(&buf->instructions);
+}
+
+void peephole_print_stats(FILE* fp)
+{
+    for (size_t p = 0; p < pattern_count; p++) {
+        fprintf(fp, "%-20s %u\n", patterns[p].name, patterns[p].hits);
+    }
+    fprintf(fp, "instructions: %zu -> %zu\n", instructions_before, instructions_after);
+}
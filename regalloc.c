@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "asm.h"
+#include "util.h"
+
+// rax and rdx are used explicitly by idiv and to return values, r10 and r11 hold spilled registers
+static const enum Register allocatable[] = {
+        REG_RBX,
+        REG_RCX,
+        REG_RSI,
+        REG_RDI,
+        REG_R8,
+        REG_R9,
+        REG_R12,
+        REG_R13,
+        REG_R14,
+        REG_R15,
+};
+
+#define ALLOCATABLE_COUNT (sizeof(allocatable) / sizeof(allocatable[0]))
+
+static const enum Register spill_scratch[] = { REG_R10, REG_R11 };
+
+enum Access {
+    ACCESS_NONE = 0,
+    ACCESS_USE = 1 << 0,
+    ACCESS_DEF = 1 << 1,
+};
+
+struct Block {
+    size_t begin; // instruction indices relative to the start of the function
+    size_t end;
+    int succ[2]; // -1 if absent
+    uint64_t* use; // read before being written in the block
+    uint64_t* def;
+    uint64_t* live_in;
+    uint64_t* live_out;
+};
+
+// positions are 2*i for the reads of instruction i and 2*i+1 for its writes, so that an instruction
+// can write to the register of an operand it reads for the last time
+struct Interval {
+    unsigned int vreg; // relative to the first virtual register of the function
+    size_t start;
+    size_t end;
+    int reg; // index in allocatable, -1 if spilled
+    int slot;
+};
+
+static bool bitset_get(const uint64_t* set, unsigned int i)
+{
+    return (set[i / 64] >> (i % 64)) & 1;
+}
+
+static void bitset_set(uint64_t* set, unsigned int i)
+{
+    set[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static unsigned int operand_access(const struct Instruction* insn, int i)
+{
+    if (insn->operands[i].kind != OPERAND_REG) {
+        return ACCESS_NONE;
+    }
+
+    switch(insn->op) {
+        case ASM_LEA:
+        case ASM_MOV:
+        case ASM_POP:
+            return (i == 0) ? ACCESS_DEF : ACCESS_USE;
+
+        case ASM_XOR:
+            // xor r, r only writes r
+            if (insn->operands[1].kind == OPERAND_REG && insn->operands[0].data.reg == insn->operands[1].data.reg) {
+                return (i == 0) ? ACCESS_DEF : ACCESS_NONE;
+            }
+            return (i == 0) ? (ACCESS_USE | ACCESS_DEF) : ACCESS_USE;
+
+        // setcc only writes the low byte
+        case ASM_ADD:
+        case ASM_IMUL:
+        case ASM_INC:
+        case ASM_SETCC:
+        case ASM_SUB:
+            return (i == 0) ? (ACCESS_USE | ACCESS_DEF) : ACCESS_USE;
+
+        default:
+            return ACCESS_USE;
+    }
+}
+
+/// Index of the operand's virtual register relative to the function, or -1 if it is not one
+static int operand_vreg(const struct AsmFunction* fun, struct Operand op)
+{
+    if (op.kind == OPERAND_MEM) {
+        ASSERT(!IS_VREG(op.data.mem.base) && "Virtual registers can't be used as a base");
+    }
+    if (op.kind != OPERAND_REG || !IS_VREG(op.data.reg)) {
+        return -1;
+    }
+
+    unsigned int vreg = op.data.reg - REG_COUNT;
+    ASSERT(vreg >= fun->first_vreg && vreg < fun->end_vreg)
+    return vreg - fun->first_vreg;
+}
+
+static bool ends_block(enum AsmOp op)
+{
+    return op == ASM_JMP || op == ASM_JCC || op == ASM_RET;
+}
+
+/// Split the function into basic blocks and link them to their successors
+static void build_blocks(const struct AsmBuffer* buf, const struct Instruction* insns, size_t n, struct dynarray* blocks)
+{
+    int* label_block = malloc(dynarray_length(&buf->labels) * sizeof(int));
+    for (size_t i = 0; i < dynarray_length(&buf->labels); i++) {
+        label_block[i] = -1;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (i == 0 || insns[i].op == ASM_LABEL || ends_block(insns[i-1].op)) {
+            struct Block block;
+            memset(&block, 0, sizeof(block));
+            block.begin = i;
+            dynarray_push(blocks, &block);
+        }
+
+        struct Block* block = dynarray_get(blocks, dynarray_length(blocks)-1);
+        block->end = i+1;
+
+        if (insns[i].op == ASM_LABEL) {
+            label_block[insns[i].operands[0].data.label] = dynarray_length(blocks)-1;
+        }
+    }
+
+    size_t count = dynarray_length(blocks);
+    for (size_t b = 0; b < count; b++) {
+        struct Block* block = dynarray_get(blocks, b);
+        const struct Instruction* last = &insns[block->end-1];
+        int next = (b+1 < count) ? (int)b+1 : -1;
+
+        block->succ[0] = -1;
+        block->succ[1] = -1;
+        if (last->op == ASM_JMP || last->op == ASM_JCC) {
+            block->succ[0] = label_block[last->operands[0].data.label];
+            ASSERT(block->succ[0] >= 0 && "Jump out of the function")
+        }
+
+        if (last->op == ASM_JCC) {
+            block->succ[1] = next;
+        } else if (last->op != ASM_JMP && last->op != ASM_RET) {
+            block->succ[0] = next;
+        }
+    }
+
+    free(label_block);
+}
+
+/// Classic backward dataflow over the blocks until nothing changes
+static void compute_liveness(const struct AsmFunction* fun, const struct Instruction* insns, struct dynarray* blocks, size_t words)
+{
+    size_t count = dynarray_length(blocks);
+
+    for (size_t b = 0; b < count; b++) {
+        struct Block* block = dynarray_get(blocks, b);
+        for (size_t i = block->begin; i < block->end; i++) {
+            // the reads of an instruction happen before its writes
+            for (int pass = 0; pass < 2; pass++) {
+                for (int k = 0; k < 2; k++) {
+                    int vreg = operand_vreg(fun, insns[i].operands[k]);
+                    unsigned int access = operand_access(&insns[i], k);
+                    if (vreg < 0) {
+                        continue;
+                    }
+
+                    if (pass == 0 && (access & ACCESS_USE) && !bitset_get(block->def, vreg)) {
+                        bitset_set(block->use, vreg);
+                    } else if (pass == 1 && (access & ACCESS_DEF)) {
+                        bitset_set(block->def, vreg);
+                    }
+                }
+            }
+        }
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t b = count; b > 0; b--) {
+            struct Block* block = dynarray_get(blocks, b-1);
+            for (size_t w = 0; w < words; w++) {
+                uint64_t out = 0;
+                for (int s = 0; s < 2; s++) {
+                    if (block->succ[s] >= 0) {
+                        struct Block* succ = dynarray_get(blocks, block->succ[s]);
+                        out |= succ->live_in[w];
+                    }
+                }
+
+                uint64_t in = block->use[w] | (out & ~block->def[w]);
+                if (out != block->live_out[w] || in != block->live_in[w]) {
+                    block->live_out[w] = out;
+                    block->live_in[w] = in;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+static void extend(struct Interval* interval, size_t pos)
+{
+    if (pos < interval->start) {
+        interval->start = pos;
+    }
+    if (pos > interval->end) {
+        interval->end = pos;
+    }
+}
+
+static int compare_start(const void* a, const void* b)
+{
+    const struct Interval* x = *(const struct Interval* const*)a;
+    const struct Interval* y = *(const struct Interval* const*)b;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+/// Assign the intervals to registers in order of their start. When all registers are taken,
+/// the interval ending last is spilled. Returns the number of spill slots
+static int linear_scan(struct Interval* intervals, unsigned int count)
+{
+    struct Interval** sorted = malloc(count * sizeof(struct Interval*));
+    unsigned int sorted_count = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        if (intervals[i].start <= intervals[i].end) {
+            sorted[sorted_count++] = &intervals[i];
+        }
+    }
+    qsort(sorted, sorted_count, sizeof(struct Interval*), compare_start);
+
+    struct Interval* active[ALLOCATABLE_COUNT];
+    unsigned int active_count = 0;
+    bool used[ALLOCATABLE_COUNT] = { false };
+    int slots = 0;
+
+    for (unsigned int i = 0; i < sorted_count; i++) {
+        struct Interval* cur = sorted[i];
+
+        for (unsigned int j = 0; j < active_count;) {
+            if (active[j]->end < cur->start) {
+                used[active[j]->reg] = false;
+                active[j] = active[--active_count];
+            } else {
+                j++;
+            }
+        }
+
+        if (active_count < ALLOCATABLE_COUNT) {
+            int reg = 0;
+            while (used[reg]) {
+                reg++;
+            }
+            used[reg] = true;
+            cur->reg = reg;
+            active[active_count++] = cur;
+            continue;
+        }
+
+        unsigned int furthest = 0;
+        for (unsigned int j = 1; j < active_count; j++) {
+            if (active[j]->end > active[furthest]->end) {
+                furthest = j;
+            }
+        }
+
+        if (active[furthest]->end > cur->end) {
+            cur->reg = active[furthest]->reg;
+            active[furthest]->reg = -1;
+            active[furthest]->slot = slots++;
+            active[furthest] = cur;
+        } else {
+            cur->slot = slots++;
+        }
+    }
+
+    free(sorted);
+    return slots;
+}
+
+/// Access of the instruction to a virtual register through any of its operands
+static unsigned int vreg_access(const struct AsmFunction* fun, const struct Instruction* insn, int vreg)
+{
+    unsigned int access = ACCESS_NONE;
+    for (int k = 0; k < 2; k++) {
+        if (operand_vreg(fun, insn->operands[k]) == vreg) {
+            access |= operand_access(insn, k);
+        }
+    }
+    return access;
+}
+
+static void emit_mov(struct dynarray* out, struct Operand dst, struct Operand src)
+{
+    struct Instruction mov;
+    mov.op = ASM_MOV;
+    mov.cond = COND_E;
+    mov.operands[0] = dst;
+    mov.operands[1] = src;
+    dynarray_push(out, &mov);
+}
+
+/// Copy the function to out with physical registers, loading and storing spilled ones around each instruction.
+/// Spill slots are placed below the frame_size bytes of locals
+static void rewrite(struct AsmFunction* fun, const struct Instruction* insns, size_t n, const struct Interval* intervals, unsigned int frame_size, int slots, struct dynarray* out)
+{
+    size_t frame_insn = SIZE_MAX;
+
+    for (size_t i = 0; i < n; i++) {
+        struct Instruction insn = insns[i];
+        if (fun->begin + i == fun->frame_insn) {
+            insn.operands[1].data.imm = frame_size + 8 * slots;
+            frame_insn = dynarray_length(out);
+        }
+
+        struct Operand spilled[2];
+        unsigned int access[2] = { ACCESS_NONE, ACCESS_NONE };
+
+        for (int k = 0; k < 2; k++) {
+            int vreg = operand_vreg(fun, insn.operands[k]);
+            if (vreg < 0) {
+                continue;
+            }
+
+            if (intervals[vreg].reg >= 0) {
+                insn.operands[k] = Operand_reg(allocatable[intervals[vreg].reg]);
+                continue;
+            }
+
+            // when both operands name the same spilled register, they share the first scratch register
+            if (k == 1 && operand_vreg(fun, insns[i].operands[0]) == vreg) {
+                insn.operands[1] = insn.operands[0];
+                continue;
+            }
+
+            spilled[k] = Operand_mem(REG_RBP, -(int32_t)(frame_size + 8 * (intervals[vreg].slot + 1)));
+            access[k] = vreg_access(fun, &insns[i], vreg);
+            insn.operands[k] = Operand_reg(spill_scratch[k]);
+
+            if (access[k] & ACCESS_USE) {
+                emit_mov(out, insn.operands[k], spilled[k]);
+            }
+        }
+
+        dynarray_push(out, &insn);
+
+        for (int k = 0; k < 2; k++) {
+            if (access[k] & ACCESS_DEF) {
+                emit_mov(out, spilled[k], insn.operands[k]);
+            }
+        }
+    }
+
+    fun->frame_insn = frame_insn;
+}
+
+static void allocate_function(const struct AsmBuffer* buf, struct AsmFunction* fun, struct dynarray* out)
+{
+    size_t n = fun->end - fun->begin;
+    const struct Instruction* insns = (const struct Instruction*)buf->instructions.data + fun->begin;
+    unsigned int vreg_count = fun->end_vreg - fun->first_vreg;
+    size_t words = (vreg_count + 63) / 64;
+
+    struct dynarray blocks;
+    dynarray_init(&blocks, sizeof(struct Block));
+    build_blocks(buf, insns, n, &blocks);
+
+    size_t block_count = dynarray_length(&blocks);
+    uint64_t* sets = calloc(4 * block_count * words + 1, sizeof(uint64_t));
+    for (size_t b = 0; b < block_count; b++) {
+        struct Block* block = dynarray_get(&blocks, b);
+        block->use = sets + (4*b) * words;
+        block->def = sets + (4*b + 1) * words;
+        block->live_in = sets + (4*b + 2) * words;
+        block->live_out = sets + (4*b + 3) * words;
+    }
+    compute_liveness(fun, insns, &blocks, words);
+
+    struct Interval* intervals = malloc((vreg_count + 1) * sizeof(struct Interval));
+    for (unsigned int v = 0; v < vreg_count; v++) {
+        intervals[v].vreg = v;
+        intervals[v].start = SIZE_MAX;
+        intervals[v].end = 0;
+        intervals[v].reg = -1;
+        intervals[v].slot = -1;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        for (int k = 0; k < 2; k++) {
+            int vreg = operand_vreg(fun, insns[i].operands[k]);
+            unsigned int access = operand_access(&insns[i], k);
+            if (vreg >= 0 && (access & ACCESS_USE)) {
+                extend(&intervals[vreg], 2*i);
+            }
+            if (vreg >= 0 && (access & ACCESS_DEF)) {
+                extend(&intervals[vreg], 2*i + 1);
+            }
+        }
+    }
+
+    for (size_t b = 0; b < block_count; b++) {
+        struct Block* block = dynarray_get(&blocks, b);
+        for (unsigned int v = 0; v < vreg_count; v++) {
+            if (bitset_get(block->live_in, v)) {
+                extend(&intervals[v], 2*block->begin);
+            }
+            if (bitset_get(block->live_out, v)) {
+                extend(&intervals[v], 2*(block->end-1) + 1);
+            }
+        }
+    }
+
+    int slots = linear_scan(intervals, vreg_count);
+
+    unsigned int frame_size = 0;
+    if (fun->frame_insn != SIZE_MAX) {
+        frame_size = insns[fun->frame_insn - fun->begin].operands[1].data.imm;
+    } else {
+        ASSERT(slots == 0 && "Spilling needs a stack frame")
+    }
+
+    size_t begin = dynarray_length(out);
+    rewrite(fun, insns, n, intervals, frame_size, slots, out);
+    fun->begin = begin;
+    fun->end = dynarray_length(out);
+
+    free(intervals);
+    free(sets);
+    dynarray_destroy(&blocks);
+}
+
+void regalloc(struct AsmBuffer* buf)
+{
+    struct dynarray out;
+    dynarray_init_with_capacity(&out, sizeof(struct Instruction), dynarray_length(&buf->instructions));
+
+    size_t copied = 0;
+    for (size_t f = 0; f < dynarray_length(&buf->functions); f++) {
+        struct AsmFunction* fun = dynarray_get(&buf->functions, f);
+
+        // instructions outside of any function are kept as they are
+        for (; copied < fun->begin; copied++) {
+            dynarray_push(&out, dynarray_get(&buf->instructions, copied));
+        }
+
+        copied = fun->end;
+        allocate_function(buf, fun, &out);
+    }
+
+    for (; copied < dynarray_length(&buf->instructions); copied++) {
+        dynarray_push(&out, dynarray_get(&buf->instructions, copied));
+    }
+
+    dynarray_destroy(&buf->instructions);
+    buf->instructions = out;
+}
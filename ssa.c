@@ -0,0 +1,500 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ir.h"
+#include "util.h"
+
+static const unsigned int no_block = UINT32_MAX;
+
+struct Cfg {
+    size_t block_count;
+    struct dynarray* preds; // unsigned int, per block
+    unsigned int* rpo; // the blocks in reverse postorder
+    unsigned int* rpo_index; // position of each block in rpo
+    unsigned int* idom; // immediate dominator, the entry is its own
+    struct dynarray* children; // unsigned int, the dominator tree
+    struct dynarray* frontier; // unsigned int, the dominance frontier of each block
+};
+
+/// Drop the blocks that can't be reached from the entry and renumber the others
+static void remove_unreachable(struct IrFunction* fun)
+{
+    size_t n = dynarray_length(&fun->blocks);
+    unsigned int* new_id = malloc(n * sizeof(unsigned int));
+    for (size_t i = 0; i < n; i++) {
+        new_id[i] = no_block;
+    }
+
+    struct dynarray stack;
+    dynarray_init(&stack, sizeof(unsigned int));
+    unsigned int entry = 0;
+    new_id[entry] = 0;
+    dynarray_push(&stack, &entry);
+    while (dynarray_length(&stack) > 0) {
+        unsigned int b = *(unsigned int*)dynarray_get(&stack, dynarray_length(&stack)-1);
+        dynarray_pop(&stack);
+
+        unsigned int succ[2];
+        unsigned int count = ir_successors(IrFunction_block(fun, b), succ);
+        for (unsigned int i = 0; i < count; i++) {
+            if (new_id[succ[i]] == no_block) {
+                new_id[succ[i]] = 0;
+                dynarray_push(&stack, &succ[i]);
+            }
+        }
+    }
+    dynarray_destroy(&stack);
+
+    // keep the reachable blocks in their original order
+    unsigned int next_id = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (new_id[i] != no_block) {
+            new_id[i] = next_id++;
+        }
+    }
+
+    struct dynarray blocks;
+    dynarray_init(&blocks, sizeof(struct IrBlock));
+    for (size_t i = 0; i < n; i++) {
+        struct IrBlock* block = IrFunction_block(fun, i);
+        if (new_id[i] == no_block) {
+            dynarray_destroy(&block->phis);
+            dynarray_destroy(&block->insts);
+            continue;
+        }
+
+        struct IrInst* term = dynarray_get(&block->insts, dynarray_length(&block->insts)-1);
+        for (int t = 0; t < 2; t++) {
+            if (term->op == IR_CONDBR || (term->op == IR_BR && t == 0)) {
+                term->targets[t] = new_id[term->targets[t]];
+            }
+        }
+        block->id = new_id[i];
+        dynarray_push(&blocks, block);
+    }
+
+    dynarray_destroy(&fun->blocks);
+    fun->blocks = blocks;
+    free(new_id);
+}
+
+static void postorder(const struct IrFunction* fun, unsigned int b, bool* visited, unsigned int* order, size_t* count)
+{
+    visited[b] = true;
+    unsigned int succ[2];
+    unsigned int succ_count = ir_successors(IrFunction_block(fun, b), succ);
+    for (unsigned int i = 0; i < succ_count; i++) {
+        if (!visited[succ[i]]) {
+            postorder(fun, succ[i], visited, order, count);
+        }
+    }
+    order[(*count)++] = b;
+}
+
+static unsigned int intersect(const struct Cfg* cfg, unsigned int a, unsigned int b)
+{
+    while (a != b) {
+        while (cfg->rpo_index[a] > cfg->rpo_index[b]) {
+            a = cfg->idom[a];
+        }
+        while (cfg->rpo_index[b] > cfg->rpo_index[a]) {
+            b = cfg->idom[b];
+        }
+    }
+    return a;
+}
+
+/// Build the predecessors, dominator tree and dominance frontiers. Every block must be reachable
+static void Cfg_init(struct Cfg* cfg, const struct IrFunction* fun)
+{
+    size_t n = dynarray_length(&fun->blocks);
+    cfg->block_count = n;
+    cfg->preds = malloc(n * sizeof(struct dynarray));
+    cfg->children = malloc(n * sizeof(struct dynarray));
+    cfg->frontier = malloc(n * sizeof(struct dynarray));
+    for (size_t i = 0; i < n; i++) {
+        dynarray_init(&cfg->preds[i], sizeof(unsigned int));
+        dynarray_init(&cfg->children[i], sizeof(unsigned int));
+        dynarray_init(&cfg->frontier[i], sizeof(unsigned int));
+    }
+
+    for (unsigned int b = 0; b < n; b++) {
+        unsigned int succ[2];
+        unsigned int count = ir_successors(IrFunction_block(fun, b), succ);
+        for (unsigned int i = 0; i < count; i++) {
+            // condbr with both targets equal is a single edge
+            if (i == 1 && succ[1] == succ[0]) {
+                break;
+            }
+            dynarray_push(&cfg->preds[succ[i]], &b);
+        }
+    }
+
+    bool* visited = calloc(n, sizeof(bool));
+    unsigned int* order = malloc(n * sizeof(unsigned int));
+    size_t count = 0;
+    postorder(fun, 0, visited, order, &count);
+    ASSERT(count == n)
+
+    cfg->rpo = malloc(n * sizeof(unsigned int));
+    cfg->rpo_index = malloc(n * sizeof(unsigned int));
+    for (size_t i = 0; i < n; i++) {
+        cfg->rpo[i] = order[n-1-i];
+        cfg->rpo_index[cfg->rpo[i]] = i;
+    }
+    free(order);
+    free(visited);
+
+    // Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm"
+    cfg->idom = malloc(n * sizeof(unsigned int));
+    for (size_t i = 0; i < n; i++) {
+        cfg->idom[i] = no_block;
+    }
+    cfg->idom[0] = 0;
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 1; i < n; i++) {
+            unsigned int b = cfg->rpo[i];
+            unsigned int new_idom = no_block;
+            for (size_t p = 0; p < dynarray_length(&cfg->preds[b]); p++) {
+                unsigned int pred = *(unsigned int*)dynarray_get(&cfg->preds[b], p);
+                if (cfg->idom[pred] == no_block) {
+                    continue;
+                }
+                new_idom = (new_idom == no_block) ? pred : intersect(cfg, pred, new_idom);
+            }
+
+            if (cfg->idom[b] != new_idom) {
+                cfg->idom[b] = new_idom;
+                changed = true;
+            }
+        }
+    }
+
+    for (unsigned int b = 1; b < n; b++) {
+        dynarray_push(&cfg->children[cfg->idom[b]], &b);
+    }
+
+    // walk up from each predecessor of a join point until reaching its dominator
+    for (unsigned int b = 0; b < n; b++) {
+        if (dynarray_length(&cfg->preds[b]) < 2) {
+            continue;
+        }
+
+        for (size_t p = 0; p < dynarray_length(&cfg->preds[b]); p++) {
+            unsigned int runner = *(unsigned int*)dynarray_get(&cfg->preds[b], p);
+            while (runner != cfg->idom[b]) {
+                struct dynarray* df = &cfg->frontier[runner];
+                size_t len = dynarray_length(df);
+                if (len == 0 || *(unsigned int*)dynarray_get(df, len-1) != b) {
+                    dynarray_push(df, &b);
+                }
+                runner = cfg->idom[runner];
+            }
+        }
+    }
+}
+
+static void Cfg_destroy(struct Cfg* cfg)
+{
+    for (size_t i = 0; i < cfg->block_count; i++) {
+        dynarray_destroy(&cfg->preds[i]);
+        dynarray_destroy(&cfg->children[i]);
+        dynarray_destroy(&cfg->frontier[i]);
+    }
+    free(cfg->preds);
+    free(cfg->children);
+    free(cfg->frontier);
+    free(cfg->rpo);
+    free(cfg->rpo_index);
+    free(cfg->idom);
+}
+
+/// Place phis for each slot at the iterated dominance frontier of the blocks that store to it
+static void place_phis(struct IrFunction* fun, const struct Cfg* cfg)
+{
+    size_t slot_count = dynarray_length(&fun->slot_names);
+    size_t n = cfg->block_count;
+
+    struct dynarray* defsites = malloc(slot_count * sizeof(struct dynarray));
+    for (size_t s = 0; s < slot_count; s++) {
+        dynarray_init(&defsites[s], sizeof(unsigned int));
+    }
+    for (unsigned int b = 0; b < n; b++) {
+        struct IrBlock* block = IrFunction_block(fun, b);
+        for (size_t i = 0; i < dynarray_length(&block->insts); i++) {
+            struct IrInst* inst = dynarray_get(&block->insts, i);
+            if (inst->op != IR_STORE) {
+                continue;
+            }
+
+            struct dynarray* sites = &defsites[inst->slot];
+            size_t len = dynarray_length(sites);
+            if (len == 0 || *(unsigned int*)dynarray_get(sites, len-1) != b) {
+                dynarray_push(sites, &b);
+            }
+        }
+    }
+
+    // both hold slot+1 for the slot currently being placed, so they never need to be cleared
+    unsigned int* has_phi = calloc(n, sizeof(unsigned int));
+    unsigned int* queued = calloc(n, sizeof(unsigned int));
+
+    for (unsigned int s = 0; s < slot_count; s++) {
+        struct dynarray* worklist = &defsites[s];
+        for (size_t i = 0; i < dynarray_length(worklist); i++) {
+            queued[*(unsigned int*)dynarray_get(worklist, i)] = s+1;
+        }
+
+        while (dynarray_length(worklist) > 0) {
+            unsigned int x = *(unsigned int*)dynarray_get(worklist, dynarray_length(worklist)-1);
+            dynarray_pop(worklist);
+
+            for (size_t i = 0; i < dynarray_length(&cfg->frontier[x]); i++) {
+                unsigned int y = *(unsigned int*)dynarray_get(&cfg->frontier[x], i);
+                if (has_phi[y] == s+1) {
+                    continue;
+                }
+
+                struct IrPhi phi;
+                phi.dst = fun->value_count++;
+                phi.slot = s;
+                dynarray_init(&phi.args, sizeof(struct IrPhiArg));
+                dynarray_push(&IrFunction_block(fun, y)->phis, &phi);
+                has_phi[y] = s+1;
+
+                // the phi is a new definition of the slot
+                if (queued[y] != s+1) {
+                    queued[y] = s+1;
+                    dynarray_push(worklist, &y);
+                }
+            }
+        }
+        dynarray_destroy(worklist);
+    }
+
+    free(queued);
+    free(has_phi);
+    free(defsites);
+}
+
+struct Renamer {
+    struct IrFunction* fun;
+    const struct Cfg* cfg;
+    struct IrOperand* current; // the value of each slot at the current point
+    struct IrOperand* replacement; // what the result of each load became, kind NONE for other values
+};
+
+static struct IrOperand resolve(const struct Renamer* r, struct IrOperand op)
+{
+    if (op.kind == IR_OPERAND_VALUE && r->replacement[op.data.value].kind != IR_OPERAND_NONE) {
+        return r->replacement[op.data.value];
+    }
+    return op;
+}
+
+/// Walk the dominator tree, replacing loads by the last value stored and filling the phi arguments
+static void rename_block(struct Renamer* r, unsigned int b)
+{
+    size_t slot_count = dynarray_length(&r->fun->slot_names);
+    struct IrOperand* saved = malloc(slot_count * sizeof(struct IrOperand));
+    memcpy(saved, r->current, slot_count * sizeof(struct IrOperand));
+
+    struct IrBlock* block = IrFunction_block(r->fun, b);
+    for (size_t i = 0; i < dynarray_length(&block->phis); i++) {
+        struct IrPhi* phi = dynarray_get(&block->phis, i);
+        r->current[phi->slot] = IrOperand_value(phi->dst);
+    }
+
+    struct dynarray insts;
+    dynarray_init(&insts, sizeof(struct IrInst));
+    for (size_t i = 0; i < dynarray_length(&block->insts); i++) {
+        struct IrInst inst = *(struct IrInst*)dynarray_get(&block->insts, i);
+        inst.args[0] = resolve(r, inst.args[0]);
+        inst.args[1] = resolve(r, inst.args[1]);
+
+        if (inst.op == IR_LOAD) {
+            r->replacement[inst.dst] = r->current[inst.slot];
+        } else if (inst.op == IR_STORE) {
+            r->current[inst.slot] = inst.args[0];
+        } else {
+            dynarray_push(&insts, &inst);
+        }
+    }
+    dynarray_destroy(&block->insts);
+    block->insts = insts;
+
+    unsigned int succ[2];
+    unsigned int succ_count = ir_successors(block, succ);
+    for (unsigned int i = 0; i < succ_count; i++) {
+        if (i == 1 && succ[1] == succ[0]) {
+            break;
+        }
+
+        struct IrBlock* succ_block = IrFunction_block(r->fun, succ[i]);
+        for (size_t p = 0; p < dynarray_length(&succ_block->phis); p++) {
+            struct IrPhi* phi = dynarray_get(&succ_block->phis, p);
+            struct IrPhiArg arg;
+            arg.block = b;
+            arg.value = r->current[phi->slot];
+            dynarray_push(&phi->args, &arg);
+        }
+    }
+
+    for (size_t i = 0; i < dynarray_length(&r->cfg->children[b]); i++) {
+        rename_block(r, *(unsigned int*)dynarray_get(&r->cfg->children[b], i));
+    }
+
+    memcpy(r->current, saved, slot_count * sizeof(struct IrOperand));
+    free(saved);
+}
+
+/// Minimal SSA places phis for variables that are dead at the join point, drop the ones nothing uses
+static void remove_dead_phis(struct IrFunction* fun)
+{
+    size_t n = dynarray_length(&fun->blocks);
+    struct IrPhi** phi_of = calloc(fun->value_count, sizeof(struct IrPhi*));
+    bool* live = calloc(fun->value_count, sizeof(bool));
+    struct dynarray worklist;
+    dynarray_init(&worklist, sizeof(unsigned int));
+
+    for (size_t b = 0; b < n; b++) {
+        struct IrBlock* block = IrFunction_block(fun, b);
+        for (size_t i = 0; i < dynarray_length(&block->phis); i++) {
+            struct IrPhi* phi = dynarray_get(&block->phis, i);
+            phi_of[phi->dst] = phi;
+        }
+        for (size_t i = 0; i < dynarray_length(&block->insts); i++) {
+            struct IrInst* inst = dynarray_get(&block->insts, i);
+            for (int a = 0; a < 2; a++) {
+                if (inst->args[a].kind == IR_OPERAND_VALUE && !live[inst->args[a].data.value]) {
+                    live[inst->args[a].data.value] = true;
+                    dynarray_push(&worklist, &inst->args[a].data.value);
+                }
+            }
+        }
+    }
+
+    while (dynarray_length(&worklist) > 0) {
+        unsigned int value = *(unsigned int*)dynarray_get(&worklist, dynarray_length(&worklist)-1);
+        dynarray_pop(&worklist);
+        if (!phi_of[value]) {
+            continue;
+        }
+
+        for (size_t i = 0; i < dynarray_length(&phi_of[value]->args); i++) {
+            struct IrPhiArg* arg = dynarray_get(&phi_of[value]->args, i);
+            if (arg->value.kind == IR_OPERAND_VALUE && !live[arg->value.data.value]) {
+                live[arg->value.data.value] = true;
+                dynarray_push(&worklist, &arg->value.data.value);
+            }
+        }
+    }
+
+    for (size_t b = 0; b < n; b++) {
+        struct IrBlock* block = IrFunction_block(fun, b);
+        size_t kept = 0;
+        for (size_t i = 0; i < dynarray_length(&block->phis); i++) {
+            struct IrPhi phi = *(struct IrPhi*)dynarray_get(&block->phis, i);
+            if (live[phi.dst]) {
+                dynarray_set(&block->phis, kept++, &phi);
+            } else {
+                dynarray_destroy(&phi.args);
+            }
+        }
+        while (dynarray_length(&block->phis) > kept) {
+            dynarray_pop(&block->phis);
+        }
+    }
+
+    dynarray_destroy(&worklist);
+    free(live);
+    free(phi_of);
+}
+
+void ir_mem2reg(struct IrFunction* fun)
+{
+    remove_unreachable(fun);
+
+    struct Cfg cfg;
+    Cfg_init(&cfg, fun);
+    place_phis(fun, &cfg);
+
+    // there is no address-of operator, so every slot can be promoted
+    size_t slot_count = dynarray_length(&fun->slot_names);
+    struct Renamer r;
+    r.fun = fun;
+    r.cfg = &cfg;
+    r.current = malloc(slot_count * sizeof(struct IrOperand));
+    r.replacement = malloc(fun->value_count * sizeof(struct IrOperand));
+    for (size_t s = 0; s < slot_count; s++) {
+        // reading an uninitialized variable is undefined, use 0
+        r.current[s] = IrOperand_const(0);
+    }
+    for (size_t v = 0; v < fun->value_count; v++) {
+        r.replacement[v].kind = IR_OPERAND_NONE;
+    }
+
+    rename_block(&r, 0);
+    remove_dead_phis(fun);
+
+    free(r.replacement);
+    free(r.current);
+    Cfg_destroy(&cfg);
+}
+
+static void insert_before_terminator(struct IrBlock* block, struct IrInst* inst)
+{
+    size_t len = dynarray_length(&block->insts);
+    struct IrInst term = *(struct IrInst*)dynarray_get(&block->insts, len-1);
+    dynarray_set(&block->insts, len-1, inst);
+    dynarray_push(&block->insts, &term);
+}
+
+void ir_leave_ssa(struct IrFunction* fun)
+{
+    for (size_t b = 0; b < dynarray_length(&fun->blocks); b++) {
+        struct IrBlock* block = IrFunction_block(fun, b);
+        if (dynarray_length(&block->phis) == 0) {
+            continue;
+        }
+
+        // Copying through a temporary per phi avoids both the lost copy problem, since the
+        // predecessors only write temporaries nothing else reads, and the swap problem, since
+        // the phis of a block all read their temporaries before any of them is written
+        struct dynarray insts;
+        dynarray_init(&insts, sizeof(struct IrInst));
+        for (size_t i = 0; i < dynarray_length(&block->phis); i++) {
+            struct IrPhi* phi = dynarray_get(&block->phis, i);
+            unsigned int temp = fun->value_count++;
+
+            for (size_t a = 0; a < dynarray_length(&phi->args); a++) {
+                struct IrPhiArg* arg = dynarray_get(&phi->args, a);
+                struct IrInst copy;
+                IrInst_init(&copy, IR_COPY);
+                copy.dst = temp;
+                copy.args[0] = arg->value;
+                insert_before_terminator(IrFunction_block(fun, arg->block), &copy);
+            }
+
+            struct IrInst copy;
+            IrInst_init(&copy, IR_COPY);
+            copy.dst = phi->dst;
+            copy.args[0] = IrOperand_value(temp);
+            dynarray_push(&insts, &copy);
+            dynarray_destroy(&phi->args);
+        }
+
+        for (size_t i = 0; i < dynarray_length(&block->insts); i++) {
+            dynarray_push(&insts, dynarray_get(&block->insts, i));
+        }
+        dynarray_destroy(&block->insts);
+        block->insts = insts;
+
+        while (dynarray_length(&block->phis) > 0) {
+            dynarray_pop(&block->phis);
+        }
+    }
+}
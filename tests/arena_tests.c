@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "../arena.h"
+#include "../util.h"
+
+int main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+
+    struct Arena arena;
+    Arena_init(&arena);
+    ASSERT(Arena_capacity(&arena) == 0);
+
+    // allocations are aligned and don't overlap
+    unsigned char* a = Arena_alloc(&arena, 3);
+    unsigned char* b = Arena_alloc(&arena, 40);
+    ASSERT((uintptr_t)a % 16 == 0);
+    ASSERT((uintptr_t)b % 16 == 0);
+    ASSERT(b >= a + 3);
+    memset(a, 0xaa, 3);
+    memset(b, 0xbb, 40);
+    ASSERT(a[2] == 0xaa);
+
+    // enough to need more blocks, and one allocation larger than a block
+    for (int i = 0; i < 10000; i++) {
+        int* p = Arena_alloc(&arena, sizeof(int) * 8);
+        p[7] = i;
+    }
+    unsigned char* big = Arena_alloc(&arena, 1024 * 1024);
+    memset(big, 0, 1024 * 1024);
+    ASSERT(Arena_capacity(&arena) >= 1024 * 1024 + 10000 * 32);
+
+    Arena_destroy(&arena);
+    ASSERT(Arena_capacity(&arena) == 0);
+
+    puts("Passed.");
+    return 0;
+}
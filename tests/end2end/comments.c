@@ -0,0 +1,11 @@
+// comments and runs of whitespace and identifier characters longer than a vector
+int main() { /* a block comment * with stars **/
+                                                                        int a0123456789abcdefghijklmnopqrstuvwxyz = 40;
+	int b = 2; /**/
+    /*
+     * a multi-line comment, with // inside
+     */
+    int aVeryLongIdentifierNameThatIsLongerThanOneVector32 = a0123456789abcdefghijklmnopqrstuvwxyz /* inline */ + b;
+    return aVeryLongIdentifierNameThatIsLongerThanOneVector32 - 1 / 1; // trailing comment
+}
+// no newline at the end
\ No newline at end of file
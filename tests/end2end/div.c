@@ -0,0 +1,5 @@
+int main() {
+    int x = 0 - 17;
+    int y = 5;
+    return x / y + 10;
+}
@@ -0,0 +1,12 @@
+int main() {
+    int a = 0;
+    int b = 1;
+    int n = 0;
+    while (n < 10) {
+        int t = a;
+        a = b;
+        b = t + b;
+        n++;
+    }
+    return a + b;
+}
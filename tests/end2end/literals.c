@@ -0,0 +1,7 @@
+int main() {
+    int a = 0x1F + 017 + 0b101;
+    int b = 123456789012 - 123456789000;
+    int c = 0xffffffffffu - 1099511627770;
+    int d = 10l + 5LU + 3ull;
+    return a + b + c + d;
+}
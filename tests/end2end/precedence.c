@@ -0,0 +1,13 @@
+int main() {
+    int a = 2 + 3 * 4 - 10 / 2 - 1;
+    int b = 1 < 2 == 1;
+    int c = 20 - 6 - 4;
+    int d = 0;
+    int e = 0;
+    d = e = a + b * c;
+    d += e += 1;
+    int f = 3;
+    int g = f++ * 2 + 1;
+    g = g + f;
+    return a + b + c + d + g + (1 + 2 == 3) + (1 == 1 < 2);
+}
@@ -0,0 +1,15 @@
+int main() {
+    int x = 1;
+    int r = 0;
+    {
+        int x = 10;
+        r += x;
+        for (int x = 100; x < 102; x++) {
+            r += x;
+        }
+        r += x;
+    }
+    { int y = 5; r += y; }
+    { int y = 6; r += y; }
+    return r + x;
+}
@@ -0,0 +1,11 @@
+int main() {
+    int a = 1;
+    int b = 2;
+    int c = 3;
+    int s = 0;
+    for (int i = 0; i < 7; i++) {
+        s = s + (a + (b * (c + (a - (b + (c * (a + (b + (c + (a + (b + (c + (a + (b * (c + i)))))))))))))));
+        s = s - s / 3;
+    }
+    return s - (100 - 7) / 2;
+}
@@ -0,0 +1,4 @@
+// error: 3:5: Expected lvalue
+int main() {
+    1 + 2 = 3;
+}
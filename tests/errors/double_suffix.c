@@ -0,0 +1,4 @@
+// error: 3:12: Invalid integer literal: 1uu
+int main() {
+    return 1uu;
+}
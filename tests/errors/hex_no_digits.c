@@ -0,0 +1,4 @@
+// error: 3:12: Invalid integer literal: 0x
+int main() {
+    return 0x;
+}
@@ -0,0 +1,4 @@
+// error: 3:12: Integer literal is too large: 18446744073709551616
+int main() {
+    return 18446744073709551616;
+}
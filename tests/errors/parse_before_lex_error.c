@@ -0,0 +1,5 @@
+// error: 3:15: Expected int, got token kind 21 instead
+int main() {
+    return 1 +;
+    int x = 0x;
+}
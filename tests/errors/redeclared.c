@@ -0,0 +1,6 @@
+// error: 4:9: Identifier already declared in this scope: a
+int main() {
+    int a = 1;
+    int a = 2;
+    return a;
+}
@@ -0,0 +1,4 @@
+// error: 3:15: Unterminated comment
+int main() {
+    return 1; /* never closed
+}
@@ -31,6 +31,21 @@ int main(int argc, char** argv)
     ASSERT(hashmap_get(&map, "a", &w));
     ASSERT(w == -12);
 
+    // far more keys than the initial capacity
+    char key[16];
+    for (int i = 0; i < 5000; i++) {
+        sprintf(key, "k%d", i);
+        hashmap_set(&map, key, &i);
+    }
+    for (int i = 0; i < 5000; i++) {
+        sprintf(key, "k%d", i);
+        ASSERT(hashmap_get(&map, key, &w));
+        ASSERT(w == i);
+    }
+    ASSERT(hashmap_get(&map, "a", &w));
+    ASSERT(w == -12);
+    ASSERT(map.count == 5002);
+
     hashmap_destroy(&map);
 
     puts("Passed.");
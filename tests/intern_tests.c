@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <string.h>
+#include "../intern.h"
+#include "../util.h"
+
+int main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+
+    unsigned int a = intern("abc", 3);
+    ASSERT(a == 0);
+    ASSERT(strcmp(intern_string(a), "abc") == 0);
+    ASSERT(intern("abcdef", 3) == a);
+    ASSERT(intern("ab", 2) != a);
+    ASSERT(intern_string(a) == intern_string(intern("abc", 3)));
+
+    // enough spellings to grow the table a few times
+    char name[16];
+    for (int i = 0; i < 2000; i++) {
+        sprintf(name, "v%d", i);
+        intern(name, strlen(name));
+    }
+    for (int i = 0; i < 2000; i++) {
+        sprintf(name, "v%d", i);
+        unsigned int id = intern(name, strlen(name));
+        ASSERT(strcmp(intern_string(id), name) == 0);
+    }
+    ASSERT(intern("abc", 3) == a);
+
+    // the spelling stays valid after the buffer it was interned from is gone
+    char* source = malloc(16);
+    strcpy(source, "int spanned;");
+    unsigned int span = intern(source + 4, 7);
+    ASSERT(intern(source + 4, 7) == span);
+    ASSERT(intern(source, 3) != span);
+    memset(source, 'x', 12);
+    free(source);
+    ASSERT(intern("spanned", 7) == span);
+    ASSERT(strcmp(intern_string(span), "spanned") == 0);
+    ASSERT(intern_count() == 2 + 2000 + 2);
+
+    puts("Passed.");
+    return 0;
+}
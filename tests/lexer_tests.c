@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <string.h>
+#include "../toycc.h"
+#include "../util.h"
+
+static struct SourceFile source_of(const char* text)
+{
+    struct SourceFile source;
+    memset(&source, 0, sizeof(source));
+    source.path = "<test>";
+    source.size = strlen(text);
+    char* data = calloc(source.size + SOURCE_PADDING, 1);
+    memcpy(data, text, source.size);
+    source.data = data;
+    return source;
+}
+
+/// Lex the text and check the kind of each token
+static void check_kinds(const char* text, const enum TokenType* kinds, size_t count)
+{
+    struct SourceFile source = source_of(text);
+    struct Lexer lexer;
+    Lexer_init(&lexer, &source);
+
+    struct Token tok;
+    for (size_t i = 0; i < count; i++) {
+        ASSERT(Lexer_next(&lexer, &tok));
+        ASSERT(tok.kind == kinds[i]);
+    }
+    ASSERT(!Lexer_next(&lexer, &tok));
+    free((char*)source.data);
+}
+
+int main(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+
+    // every keyword has its own slot in the keyword table
+    const enum TokenType keywords[] = {
+        TOK_KW_IF, TOK_KW_INT, TOK_KW_WHILE, TOK_KW_RETURN, TOK_KW_FOR, TOK_KW_ELSE,
+    };
+    check_kinds("if int while return for else", keywords, 6);
+
+    // spellings that share a slot, a prefix or a length with a keyword are identifiers
+    const char* near_misses[] = {
+        "i", "iff", "in", "inT", "Int", "ints", "whilE", "whil", "returns", "retur", "fo", "fro",
+        "els", "elsE", "elif", "fi", "nit", "x", "abcdef", "ab",
+    };
+    for (size_t i = 0; i < sizeof(near_misses) / sizeof(near_misses[0]); i++) {
+        const enum TokenType ident = TOK_IDENT;
+        check_kinds(near_misses[i], &ident, 1);
+    }
+
+    puts("Passed.");
+    return 0;
+}
@@ -3,6 +3,10 @@
 #include <stdio.h>
 #include "dynarray.h"
 #include "hashmap.h"
+#include "asm.h"
+#include "ir.h"
+#include "intern.h"
+#include "util.h"
 
 enum TokenType {
     TOK_ADD,
@@ -14,6 +18,12 @@ enum TokenType {
     TOK_IDENT,
     TOK_INCREMENT,
     TOK_INT,
+    TOK_KW_ELSE,
+    TOK_KW_FOR,
+    TOK_KW_IF,
+    TOK_KW_INT,
+    TOK_KW_RETURN,
+    TOK_KW_WHILE,
     TOK_LEFT_CURLY_BRACKET,
     TOK_LEFT_PAREN,
     TOK_LESS_THAN,
@@ -22,16 +32,60 @@ enum TokenType {
     TOK_RIGHT_PAREN,
     TOK_SEMICOLON,
     TOK_SUB,
+    TOK_ERROR, // not a token: where lex_parallel stopped at a lexing error, see TokenStream.error
+    TOK_COUNT, // not a token, the number of kinds
 };
 
 struct Token {
-    enum TokenType kind;
+    uint8_t kind; // enum TokenType
+    uint32_t offset; // where the token starts in the input
     union {
         int64_t i64;
-        char* ident;
+        unsigned int ident; // interned symbol ID
+        uint32_t span_len; // instead of ident when the lexer defers interning
     } data;
 };
 
+/// Produces the tokens of an input one at a time, so that they never have to be stored all at once
+struct Lexer {
+    struct SourceFile* source;
+    const char* input;
+    const char* end;
+    const char* stop; // tokens starting here or later are left to another lexer
+    const char* p; // where the next token, or the whitespace before it, starts
+    bool defer_interning;
+    // when set, an error stops the lexer and is kept here instead of being reported, so that a worker
+    // thread never calls SourceFile_error
+    bool record_errors;
+    bool failed;
+    uint32_t error_offset;
+    char error[128];
+};
+
+void Lexer_init(struct Lexer* lexer, struct SourceFile* source);
+/// Write the next token to tok, return false at the end of the input or, with record_errors, at the
+/// first error
+bool Lexer_next(struct Lexer* lexer, struct Token* tok);
+/// Tokens stored as parallel arrays indexed by token: 9 bytes each instead of a 16-byte struct Token,
+/// and a lookahead on kinds touches one byte per token
+struct TokenStream {
+    struct dynarray kinds; // uint8_t, enum TokenType
+    struct dynarray payloads; // uint32_t: the symbol ID of a TOK_IDENT, the index in literals of a TOK_INT
+    struct dynarray offsets; // uint32_t, where the token starts in the input
+    struct dynarray literals; // int64_t
+    char error[128]; // the message of the TOK_ERROR that ends the stream, if there is one
+};
+
+void TokenStream_init(struct TokenStream* tokens, size_t capacity);
+void TokenStream_destroy(struct TokenStream* tokens);
+size_t TokenStream_length(const struct TokenStream* tokens);
+/// Append tok. A TOK_IDENT lexed with defer_interning keeps its span length as the payload
+void TokenStream_push(struct TokenStream* tokens, const struct Token* tok);
+void TokenStream_get(const struct TokenStream* tokens, size_t index, struct Token* tok);
+
+/// Lex the whole input with up to threads threads
+void lex_parallel(struct SourceFile* source, unsigned int threads, struct TokenStream* tokens);
+
 enum NodeKind {
     NODE_ADD,
     NODE_ASSIGN,
@@ -84,7 +138,8 @@ struct VariableDeclaration {
 };
 
 struct Declaration {
-    const char* ident;
+    unsigned int sym;
+    const char* ident; // the interned spelling of sym
     enum DeclKind kind;
     struct Type type;
     union {
@@ -93,22 +148,71 @@ struct Declaration {
     } data;
 };
 
-struct Scope {
-    const struct Scope* parent;
-    struct hashmap decls;
+/// Every declaration of the program, stored once. AST nodes and scopes refer to them by index
+struct SymbolTable {
+    struct dynarray decls; // struct Declaration
+};
+
+#define NO_DECL UINT32_MAX
+
+struct Binding {
+    uint32_t decl; // NO_DECL when the identifier isn't declared
+    uint32_t depth; // of the scope that declared it
+};
+
+/// The declarations visible at the current point of the parse. Each identifier has one binding;
+/// declaring it again in an inner scope logs the binding it shadows, and leaving the scope
+/// restores the logged bindings
+struct ScopeStack {
+    struct Binding* bindings; // indexed by interned ID
+    size_t capacity;
+    struct dynarray undo; // struct Shadowed
+    struct dynarray marks; // size_t, the length of undo when each open scope was entered
 };
 
 struct ASTNode {
     enum NodeKind kind;
-    struct dynarray children;
+    uint32_t child_count;
+    struct ASTNode** children; // in the same arena allocation as the node
 
     union {
         int64_t i64;
-        struct Declaration decl;
+        uint32_t decl; // NODE_DECL, NODE_FUNCTION_DEF and NODE_IDENT, an index into the symbol table
     } data;
 };
 
-void tokenize(struct dynarray* tokens, const char* input);
-void codegen(struct ASTNode program, FILE* fp);
-struct ASTNode parse(struct dynarray tokens);
+/// The tree after folding, in post-order with one entry per node in each array. The subtree of node i
+/// is [i - sizes[i] + 1, i], so an expression can be evaluated by a linear scan of it. Assignments
+/// and ++ hold their variable in data instead of a NODE_IDENT child
+struct FlatAST {
+    uint32_t count;
+    uint8_t* kinds; // enum NodeKind
+    uint32_t* child_counts;
+    uint32_t* sizes; // including the node itself
+    int64_t* data; // the value of NODE_INT, the symbol table index of a declaration or variable
+};
+
+void SymbolTable_init(struct SymbolTable* symbols);
+void SymbolTable_destroy(struct SymbolTable* symbols);
+uint32_t SymbolTable_add(struct SymbolTable* symbols, const struct Declaration* decl);
+/// The pointer is invalidated by the next SymbolTable_add
+struct Declaration* SymbolTable_get(const struct SymbolTable* symbols, uint32_t index);
+
+struct Arena;
+
+struct IrProgram irgen(const struct FlatAST* ast, const struct SymbolTable* symbols);
+void codegen(struct IrProgram* program, struct AsmBuffer* buf);
+/// With lex_threads > 1 the input is lexed in parallel before parsing, otherwise the parser lexes as
+/// it goes and the tokens are never all in memory
+/// The nodes are allocated in the arena, and freed with it. The declarations are added to symbols
+struct ASTNode* parse(struct SourceFile* source, unsigned int lex_threads, struct Arena* arena, struct SymbolTable* symbols);
+/// A leaf that isn't allocated in an arena
+void ASTNode_init(struct ASTNode* node, enum NodeKind kind);
+struct ASTNode* ASTNode_new(struct Arena* arena, enum NodeKind kind, uint32_t child_count);
+/// Fold constant expressions and simplify identities in place, return the number of nodes removed
+unsigned int fold_constants(struct ASTNode* node);
+void FlatAST_init(struct FlatAST* flat, const struct ASTNode* root);
+void FlatAST_destroy(struct FlatAST* flat);
+/// Write the indices of the node's children, in order, to children[0 .. child_counts[node])
+void FlatAST_children(const struct FlatAST* flat, uint32_t node, uint32_t* children);
 #endif //CCOMP_TOYCC_H
@@ -1,28 +1,155 @@
+#define _DEFAULT_SOURCE
 #include "util.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-char* read_file(const char* path)
+/// Read until the end of the file, for pipes and terminals that can't be mapped
+static void read_all(struct SourceFile* file, int fd, const char* path)
 {
-    FILE* fp = fopen(path, "r");
-    if (!fp) {
+    size_t capacity = 4096;
+    char* buf = malloc(capacity + SOURCE_PADDING);
+    size_t size = 0;
+    while (true) {
+        if (size == capacity) {
+            capacity *= 2;
+            buf = realloc(buf, capacity + SOURCE_PADDING);
+        }
+        ssize_t n = read(fd, buf + size, capacity - size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+        if (n == 0) {
+            break;
+        }
+        size += n;
+    }
+
+    memset(buf + size, 0, SOURCE_PADDING);
+    file->data = buf;
+    file->size = size;
+    file->mapped_size = 0;
+}
+
+/// Map the file read-only, followed by zero pages for the padding. The file is mapped over an
+/// anonymous mapping that is large enough for both, the bytes after the end of the file in its
+/// last page read as zero too
+static bool map_file(struct SourceFile* file, int fd, size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t mapped_size = (size + SOURCE_PADDING + page - 1) / page * page;
+
+    void* mem = mmap(NULL, mapped_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return false;
+    }
+    if (size > 0 && mmap(mem, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(mem, mapped_size);
+        return false;
+    }
+
+    file->data = mem;
+    file->size = size;
+    file->mapped_size = mapped_size;
+    return true;
+}
+
+void SourceFile_open(struct SourceFile* file, const char* path)
+{
+    int fd = (strcmp(path, "-") == 0) ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0) {
         fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
         exit(1);
     }
-    fseek(fp, 0, SEEK_END);
-    size_t size = ftell(fp);
-    rewind(fp);
 
-    char* buf = malloc(size+1);
+    file->path = path;
+    file->has_line_table = false;
 
-    if (fread(buf, 1, size, fp) != size) {
-        fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
-        exit(1);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || !map_file(file, fd, st.st_size)) {
+        read_all(file, fd, path);
     }
 
-    buf[size] = 0;
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+}
+
+void SourceFile_close(struct SourceFile* file)
+{
+    if (file->has_line_table) {
+        dynarray_destroy(&file->line_starts);
+    }
+
+    if (file->mapped_size) {
+        munmap((void*)file->data, file->mapped_size);
+    } else {
+        free((void*)file->data);
+    }
+}
+
+/// Only diagnostics need lines, so the lexer doesn't count them. memchr is vectorized by the C
+/// library
+static void build_line_table(struct SourceFile* file)
+{
+    dynarray_init(&file->line_starts, sizeof(uint32_t));
+    uint32_t start = 0;
+    dynarray_push(&file->line_starts, &start);
+
+    const char* end = file->data + file->size;
+    const char* p = file->data;
+    while ((p = memchr(p, '\n', end - p))) {
+        p++;
+        start = p - file->data;
+        dynarray_push(&file->line_starts, &start);
+    }
+    file->has_line_table = true;
+}
+
+struct SourceLocation SourceFile_locate(struct SourceFile* file, uint32_t offset)
+{
+    if (!file->has_line_table) {
+        build_line_table(file);
+    }
+
+    // the last line starting at or before offset
+    const uint32_t* starts = (const uint32_t*)file->line_starts.data;
+    size_t lo = 0;
+    size_t hi = dynarray_length(&file->line_starts);
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (starts[mid] <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    struct SourceLocation loc;
+    loc.line = lo + 1;
+    loc.column = offset - starts[lo] + 1;
+    return loc;
+}
+
+void SourceFile_error(struct SourceFile* file, uint32_t offset, const char* fmt, ...)
+{
+    struct SourceLocation loc = SourceFile_locate(file, offset);
+    fprintf(stderr, "%s:%u:%u: ", file->path, loc.line, loc.column);
 
-    return buf;
-}
\ No newline at end of file
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+    exit(1);
+}
@@ -1,5 +1,9 @@
 #ifndef CCOMP_UTIL_H
 #define CCOMP_UTIL_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "dynarray.h"
 
 #define ASSERT(cond) \
     if (!(cond)) { \
@@ -7,5 +11,30 @@
         exit(2); \
     } \
 
-char* read_file(const char* path);
+/// Sources are followed by this many NUL bytes, so that the lexer can load a whole vector at any
+/// position up to the end
+#define SOURCE_PADDING 32
+
+struct SourceFile {
+    const char* path;
+    const char* data; // size bytes, then SOURCE_PADDING NUL bytes
+    size_t size;
+    size_t mapped_size; // 0 if data was read into the heap instead
+    bool has_line_table;
+    struct dynarray line_starts; // uint32_t, the offset of each line, built by the first SourceFile_locate
+};
+
+/// 1-based, the column counts bytes
+struct SourceLocation {
+    unsigned int line;
+    unsigned int column;
+};
+
+/// Map the file, or read it when it can't be mapped, like a pipe. "-" is the standard input
+void SourceFile_open(struct SourceFile* file, const char* path);
+void SourceFile_close(struct SourceFile* file);
+struct SourceLocation SourceFile_locate(struct SourceFile* file, uint32_t offset);
+/// Print "path:line:column: " and the message, and exit
+__attribute__((noreturn, format(printf, 3, 4)))
+void SourceFile_error(struct SourceFile* file, uint32_t offset, const char* fmt, ...);
 #endif //CCOMP_UTIL_H